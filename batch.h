@@ -0,0 +1,185 @@
+#pragma once
+
+#include "raster.h"
+#include "queue.h"
+
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <iomanip>
+
+// A camera pose as used by Camera, read one per line from a pose file as
+// "x y z yaw pitch". Blank lines and lines starting with # are ignored
+class Pose {
+public:
+	size_t index = 0;	// Line order in the pose file, used to name the output image
+	float x = 0, y = 0, z = 0;
+	float fYaw = 0, fPitch = 0;
+
+	Camera toCamera() const {
+		Camera camera(Vec3d(x, y, z));
+		camera.fYaw = fYaw;
+		camera.fPitch = fPitch;
+		return camera;
+	}
+};
+
+
+// Renders a list of camera poses to image files with no window. The mesh is loaded once and
+// shared read only by the worker threads. Poses are streamed from the file and frame buffers
+// come from a fixed pool, so memory stays flat no matter how many poses there are
+class BatchRenderer {
+public:
+	BatchRenderer(std::string modelFile, int w, int h, std::string posesFile, std::string outDir)
+		: modelFile(modelFile), posesFile(posesFile), outDir(outDir), width(w), height(h) {}
+
+	int threads = 0;		// Render threads, 0 means one per core
+	int writers = 1;		// Image writer threads
+	std::string extension = ".png";
+
+	int Run(){
+		if (!mesh.LoadFromObjectFile(modelFile)){
+			std::cerr << "Failed to load model " << modelFile << std::endl;
+			return -1;
+		}
+
+		std::ifstream poses(posesFile);
+		if (!poses.is_open()){
+			std::cerr << "Failed to open pose file " << posesFile << std::endl;
+			return -1;
+		}
+
+		int nThreads = threads > 0 ? threads : (int)std::max(1u, std::thread::hardware_concurrency());
+		int nWriters = std::max(1, writers);
+
+		// Frame buffers in flight are limited to the pool, shared between rendering and writing
+		size_t poolSize = (size_t)(nThreads + nWriters) * 2;
+		BoundedQueue<Pose> jobs(nThreads * 4);
+		BoundedQueue<Job> writeQueue(poolSize);
+		BoundedQueue<std::unique_ptr<FrameBuffer>> freeBuffers(poolSize);
+		for (size_t i = 0; i < poolSize; i++)
+			freeBuffers.Push(std::unique_ptr<FrameBuffer>(new FrameBuffer(width, height)));
+
+		std::atomic<size_t> nWritten(0);
+		std::atomic<size_t> nFailed(0);
+		std::atomic<bool> bOutOfMemory(false);
+
+		// An allocation refused under --mem-cap stops the whole run. Closing the queues wakes
+		// every thread, the writers still finish the images already rendered
+		auto outOfMemory = [&](const char *where){
+			if (!bOutOfMemory.exchange(true))
+				std::cerr << "Out of memory in " << where << " thread, stopping" << std::endl;
+			jobs.Close();
+			freeBuffers.Close();
+		};
+
+		auto tStart = std::chrono::steady_clock::now();
+
+		// Render workers, each with its own pipeline and scratch storage
+		std::vector<std::thread> renderThreads;
+		for (int t = 0; t < nThreads; t++){
+			renderThreads.emplace_back([&]{
+				try {
+					Pipeline pipeline(width, height);
+					DrawList drawList;
+					Pose pose;
+					while (jobs.Pop(pose)){
+						std::unique_ptr<FrameBuffer> fb;
+						if (!freeBuffers.Pop(fb))
+							break;
+
+						Camera camera = pose.toCamera();
+						pipeline.Render(camera, mesh, drawList);
+
+						fb->Clear(255, 255, 255);
+						fb->Draw(drawList);
+
+						writeQueue.Push(Job{ pose.index, std::move(fb) });
+					}
+				} catch (const std::bad_alloc &) {
+					outOfMemory("render");
+				}
+			});
+		}
+
+		// Writers return buffers to the pool once they are on disk
+		std::vector<std::thread> writerThreads;
+		for (int t = 0; t < nWriters; t++){
+			writerThreads.emplace_back([&]{
+				Job job;
+				while (writeQueue.Pop(job)){
+					try {
+						std::string sFilename = OutputName(job.index);
+						if (ImageWriter::Write(sFilename, *job.fb)){
+							nWritten++;
+						} else {
+							if (nFailed++ == 0)
+								std::cerr << "Failed to write " << sFilename << std::endl;
+						}
+					} catch (const std::bad_alloc &) {
+						outOfMemory("writer");
+					}
+					freeBuffers.Push(std::move(job.fb));
+				}
+			});
+		}
+
+		// Stream poses to the workers
+		std::string line;
+		size_t nPoses = 0;
+		size_t lineNumber = 0;
+		while (std::getline(poses, line)){
+			lineNumber++;
+			if (line.empty() || line[0] == '#')
+				continue;
+
+			std::stringstream s(line);
+			Pose pose;
+			if (!(s >> pose.x >> pose.y >> pose.z >> pose.fYaw >> pose.fPitch)){
+				std::cerr << "Skipping bad pose on line " << lineNumber << std::endl;
+				continue;
+			}
+			pose.index = nPoses;
+			if (!jobs.Push(pose))
+				break;
+			nPoses++;
+		}
+
+		jobs.Close();
+		for (auto &t : renderThreads)
+			t.join();
+		writeQueue.Close();
+		for (auto &t : writerThreads)
+			t.join();
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - tStart;
+		double seconds = elapsed.count();
+
+		std::cout << "Rendered " << nWritten << " of " << nPoses << " poses (" << mesh.tris.size() << " triangles, "
+			<< width << "x" << height << ") with " << nThreads << " threads in " << seconds << " s, "
+			<< (seconds > 0.0 ? nWritten / seconds : 0.0) << " images/s" << std::endl;
+		MemoryStats::Get().Report(std::cout);
+
+		return nFailed == 0 && !bOutOfMemory ? 0 : -1;
+	}
+
+private:
+	class Job {
+	public:
+		size_t index = 0;
+		std::unique_ptr<FrameBuffer> fb;
+	};
+
+	Mesh mesh;
+	std::string modelFile;
+	std::string posesFile;
+	std::string outDir;
+	int width;
+	int height;
+
+	std::string OutputName(size_t index){
+		std::stringstream s;
+		s << outDir << "/frame_" << std::setw(6) << std::setfill('0') << index << extension;
+		return s.str();
+	}
+};
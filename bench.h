@@ -0,0 +1,365 @@
+#pragma once
+
+#include "raster.h"
+#include "terrain.h"
+#include "bvh.h"
+#include "visibility.h"
+
+#include <random>
+
+// Headless benchmark, loads each model, renders a fixed set of frames on the CPU and
+// reports frame time and memory use per subsystem
+class Benchmark {
+public:
+	int width = 1200;
+	int height = 800;
+	int nFrames = 50;
+
+	int Run(const std::vector<std::string> &models){
+		int result = 0;
+		for (auto &sFilename : models){
+			if (!RunModel(sFilename))
+				result = -1;
+		}
+		return result;
+	}
+
+private:
+	bool RunModel(const std::string &sFilename){
+		MemoryStats::Get().ResetPeaks();
+
+		Mesh mesh;
+		auto tLoad = std::chrono::steady_clock::now();
+		if (!mesh.LoadFromObjectFile(sFilename)){
+			std::cerr << "Failed to load model " << sFilename << std::endl;
+			return false;
+		}
+		std::chrono::duration<double> loadTime = std::chrono::steady_clock::now() - tLoad;
+
+		Pipeline pipeline(width, height);
+		DrawList drawList;
+		FrameBuffer fb(width, height);
+
+		// Orbit the default viewer camera around the origin
+		auto tRender = std::chrono::steady_clock::now();
+		for (int i = 0; i < nFrames; i++){
+			MemoryStats::Get().BeginFrame();
+
+			float a = 6.28318f * i / nFrames;
+			Camera camera(Vec3d(-5.0f * sinf(a), 0.0f, -5.0f * cosf(a)));
+			camera.fYaw = -a;	// Looking at the origin from every point
+			camera.fPitch = 0.0f;
+
+			pipeline.Render(camera, mesh, drawList);
+			fb.Clear(255, 255, 255);
+			fb.Draw(drawList);
+		}
+		std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - tRender;
+
+		std::cout << "== " << sFilename << ": " << mesh.tris.size() << " triangles, load " << loadTime.count() * 1000.0
+			<< " ms, " << renderTime.count() * 1000.0 / nFrames << " ms/frame at " << width << "x" << height << std::endl;
+		MemoryStats::Get().Report(std::cout);
+
+		Heightfield field;
+		if (Heightfield::FromMesh(mesh, field)){
+			// The same flight over the terrain as loaded and over ones 10 and 40 times as wide and deep.
+			// Past the view distance the size of the terrain should make no difference.
+			// Every frame is also checked for cracks where tiles of different levels meet
+			size_t nSeamGaps = 0;
+			float maxGap = 0.0f;
+			std::cout << "   terrain " << field.nx << "x" << field.nz << " samples:";
+			for (int nRepeat : { 1, 10, 40 })
+				std::cout << " " << nRepeat << "x " << TerrainFrameTime(field, nRepeat, nSeamGaps, maxGap) << " ms/frame";
+			std::cout << ", " << nSeamGaps << " seam gaps (largest " << maxGap << ")" << std::endl;
+			if (nSeamGaps != 0){
+				std::cerr << "   terrain tiles do not meet" << std::endl;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Average CPU frame time drawing a heightfield repeated (mirrored) nRepeat times along each axis.
+	// Adds the seam gaps seen from each camera position to nSeamGaps and maxGap
+	double TerrainFrameTime(const Heightfield &source, int nRepeat, size_t &nSeamGaps, float &maxGap){
+		Heightfield field;
+		field.spacing = source.spacing;
+		field.nx = (source.nx - 1) * nRepeat + 1;
+		field.nz = (source.nz - 1) * nRepeat + 1;
+		field.x0 = -0.5f * (field.nx - 1) * field.spacing;
+		field.z0 = -0.5f * (field.nz - 1) * field.spacing;
+		field.heights.resize((size_t)field.nx * field.nz);
+		for (int j = 0; j < field.nz; j++){
+			for (int i = 0; i < field.nx; i++){
+				int si = i % (2 * (source.nx - 1));
+				int sj = j % (2 * (source.nz - 1));
+				if (si >= source.nx) si = 2 * (source.nx - 1) - si;
+				if (sj >= source.nz) sj = 2 * (source.nz - 1) - sj;
+				field.heights[(size_t)j * field.nx + i] = source.at(si, sj);
+			}
+		}
+
+		Terrain terrain;
+		terrain.Build(std::move(field));
+
+		Pipeline pipeline(width, height);
+		DrawList drawList;
+		FrameBuffer fb(width, height);
+		TrackedVector<Triangle, MemTag::ClipScratch> tris;
+
+		// Circle above the middle of the terrain, looking slightly down
+		float radius = 0.25f * (source.nx - 1) * source.spacing;
+		auto tRender = std::chrono::steady_clock::now();
+		for (int i = 0; i < nFrames; i++){
+			float a = 6.28318f * i / nFrames;
+			Camera camera(Vec3d(radius * sinf(a), 40.0f, radius * cosf(a)));
+			camera.fYaw = a + 1.5708f;
+			camera.fPitch = 0.3f;
+
+			pipeline.Begin(camera);
+			tris.clear();
+			terrain.Generate(camera.pos, pipeline.frustum, tris);
+			pipeline.Submit(tris.data(), tris.size());
+			pipeline.End(drawList);
+			fb.Clear(255, 255, 255);
+			fb.Draw(drawList);
+		}
+		std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - tRender;
+
+		for (int i = 0; i < nFrames; i++){
+			float a = 6.28318f * i / nFrames;
+			float gap;
+			nSeamGaps += terrain.CountSeamGaps(Vec3d(radius * sinf(a), 40.0f, radius * cosf(a)), gap);
+			maxGap = std::max(maxGap, gap);
+		}
+		return renderTime.count() * 1000.0 / nFrames;
+	}
+};
+
+
+// Headless ray query benchmark. Builds a BVH over each model, traces the primary rays of the
+// same orbit as Benchmark in rays per second, then checks rays and sphere sweeps against the
+// brute force queries
+class RayBenchmark {
+public:
+	int width = 320;
+	int height = 200;
+	int nFrames = 50;
+	int nChecks = 5000;	// Random rays and sweeps compared with brute force
+
+	int Run(const std::vector<std::string> &models){
+		int result = 0;
+		for (auto &sFilename : models){
+			if (!RunModel(sFilename))
+				result = -1;
+		}
+		return result;
+	}
+
+private:
+	bool RunModel(const std::string &sFilename){
+		Mesh mesh;
+		if (!mesh.LoadFromObjectFile(sFilename)){
+			std::cerr << "Failed to load model " << sFilename << std::endl;
+			return false;
+		}
+
+		Bvh bvh;
+		auto tBuild = std::chrono::steady_clock::now();
+		bvh.Build(mesh);
+		std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - tBuild;
+		std::cout << "== " << sFilename << ": " << mesh.tris.size() << " triangles, BVH " << bvh.nodes.size() << " nodes built in "
+			<< buildTime.count() * 1000.0 << " ms" << std::endl;
+
+		// Camera rays in packets of 4x2 pixels, which keeps each packet coherent
+		TrackedVector<RayPacket, MemTag::ClipScratch> packets;
+		packets.reserve((size_t)nFrames * width * height / RayPacket::size);
+		for (int i = 0; i < nFrames; i++){
+			float a = 6.28318f * i / nFrames;
+			Camera camera(Vec3d(-5.0f * sinf(a), 0.0f, -5.0f * cosf(a)));
+			camera.fYaw = -a;	// Looking at the origin, as in Benchmark
+			camera.fPitch = 0.0f;
+			camera.matView();
+
+			Vec3d forward = camera.lookDir.normalise();
+			Vec3d up = Vec3d(0, 1, 0);
+			up = (up - forward * up.dot_product(forward)).normalise();
+			Vec3d right = up.cross_product(forward);
+			float tanV = tanf(Pipeline::fFov * 0.5f / 180.0f * 3.14159f);
+			float tanH = tanV * width / height;
+
+			for (int y = 0; y < height; y += 2){
+				for (int x = 0; x < width; x += 4){
+					RayPacket packet;
+					for (int r = 0; r < RayPacket::size; r++){
+						float sx = ((x + r % 4 + 0.5f) / width * 2.0f - 1.0f) * tanH;
+						float sy = ((y + r / 4 + 0.5f) / height * 2.0f - 1.0f) * tanV;
+						packet.rays[r] = Ray(camera.pos, forward + right * sx + up * sy);
+					}
+					packets.push_back(packet);
+				}
+			}
+		}
+
+		double nRays = (double)packets.size() * RayPacket::size;
+		for (RayQuery query : { RayQuery::Closest, RayQuery::Any }){
+			const char *name = query == RayQuery::Closest ? "closest" : "any";
+
+			auto tSingle = std::chrono::steady_clock::now();
+			size_t nSingleHits = 0;
+			for (auto &packet : packets){
+				for (int r = 0; r < RayPacket::size; r++){
+					RayHit hit;
+					nSingleHits += bvh.Intersect(packet.rays[r], hit, query);
+				}
+			}
+			std::chrono::duration<double> singleTime = std::chrono::steady_clock::now() - tSingle;
+
+			auto tPacket = std::chrono::steady_clock::now();
+			size_t nPacketHits = 0;
+			for (auto &packet : packets){
+				bvh.IntersectPacket(packet, query);
+				for (int r = 0; r < RayPacket::size; r++)
+					nPacketHits += packet.hits[r].tri >= 0;
+			}
+			std::chrono::duration<double> packetTime = std::chrono::steady_clock::now() - tPacket;
+
+			std::cout << "   " << name << " hit: single " << nRays / singleTime.count() / 1e6 << " Mrays/s, packets of "
+				<< RayPacket::size << " " << nRays / packetTime.count() / 1e6 << " Mrays/s, "
+				<< (int)(100.0 * nSingleHits / nRays) << "% of rays hit" << std::endl;
+			if (nSingleHits != nPacketHits){
+				std::cerr << "   packet and single ray hit counts differ: " << nPacketHits << " and " << nSingleHits << std::endl;
+				return false;
+			}
+		}
+
+		return CheckAgainstBruteForce(mesh, bvh);
+	}
+
+	// Random rays and sweeps from around the model's bounds, every result must match brute force
+	bool CheckAgainstBruteForce(const Mesh &mesh, const Bvh &bvh){
+		const BvhNode &root = bvh.nodes[0];
+		Vec3d centre(0.5f * (root.boxMin[0] + root.boxMax[0]), 0.5f * (root.boxMin[1] + root.boxMax[1]), 0.5f * (root.boxMin[2] + root.boxMax[2]));
+		Vec3d extent(root.boxMax[0] - root.boxMin[0], root.boxMax[1] - root.boxMin[1], root.boxMax[2] - root.boxMin[2]);
+		float size = std::max({ extent.x, extent.y, extent.z });
+
+		std::mt19937 rng(1234);
+		std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+		auto randomPoint = [&](float scale){
+			return centre + Vec3d(unit(rng), unit(rng), unit(rng)) * (scale * size);
+		};
+
+		int nRayErrors = 0, nAnyErrors = 0, nPacketErrors = 0, nSweepErrors = 0, nSweepHits = 0;
+		for (int i = 0; i < nChecks; i++){
+			Vec3d origin = randomPoint(0.75f);
+			Ray ray(origin, randomPoint(0.5f) - origin);
+
+			RayHit hit, ref;
+			bool bHit = bvh.Intersect(ray, hit);
+			bool bRef = Bvh::IntersectBruteForce(mesh, ray, ref);
+			if (bHit != bRef || (bHit && hit.t != ref.t))
+				nRayErrors++;
+
+			// Any hit can return a different triangle, but must agree on whether there is one
+			RayHit any;
+			if (bvh.Intersect(ray, any, RayQuery::Any) != bRef)
+				nAnyErrors++;
+
+			// One packet of rays fanning out from the same origin
+			if (i % RayPacket::size == 0){
+				RayPacket packet;
+				for (int r = 0; r < RayPacket::size; r++)
+					packet.rays[r] = Ray(origin, randomPoint(0.5f) - origin);
+				bvh.IntersectPacket(packet);
+				for (int r = 0; r < RayPacket::size; r++){
+					Bvh::IntersectBruteForce(mesh, packet.rays[r], ref);
+					if (packet.hits[r].t != ref.t)
+						nPacketErrors++;
+				}
+			}
+
+			// Short sweeps of a sphere a few percent of the model size
+			Vec3d from = randomPoint(0.6f);
+			Vec3d to = from + Vec3d(unit(rng), unit(rng), unit(rng)) * (0.2f * size);
+			float radius = (0.01f + 0.04f * (unit(rng) + 1.0f)) * size;
+			SweepHit sweep, sweepRef;
+			bool bSweep = bvh.SweepSphere(from, to, radius, sweep);
+			bool bSweepRef = Bvh::SweepSphereBruteForce(mesh, from, to, radius, sweepRef);
+			nSweepHits += bSweepRef;
+			if (bSweep != bSweepRef || sweep.t != sweepRef.t)
+				nSweepErrors++;
+		}
+
+		std::cout << "   brute force check: " << nChecks << " rays, " << nRayErrors << " closest and " << nAnyErrors << " any hit mismatches, "
+			<< nPacketErrors << " packet mismatches, " << nChecks << " sweeps (" << nSweepHits << " hit), " << nSweepErrors << " mismatches" << std::endl;
+		return nRayErrors == 0 && nAnyErrors == 0 && nPacketErrors == 0 && nSweepErrors == 0;
+	}
+};
+
+
+// Headless check of VisibilityCache. Flies the camera around each model in small steps with a
+// jump every 100 frames, and compares every frame's draw list with a full Pipeline::Render
+class VisibilityCheck {
+public:
+	int width = 1200;
+	int height = 800;
+	int nFrames = 400;
+
+	int Run(const std::vector<std::string> &models){
+		int result = 0;
+		for (auto &sFilename : models){
+			if (!RunModel(sFilename))
+				result = -1;
+		}
+		return result;
+	}
+
+private:
+	bool RunModel(const std::string &sFilename){
+		Mesh mesh;
+		if (!mesh.LoadFromObjectFile(sFilename)){
+			std::cerr << "Failed to load model " << sFilename << std::endl;
+			return false;
+		}
+
+		Pipeline full(width, height), cached(width, height);
+		DrawList fullList, cachedList;
+		VisibilityCache cache;
+
+		double fullTime = 0, cachedTime = 0;
+		size_t nFacingChecks = 0, nViewChecks = 0, nCulled = 0;
+		int nMismatches = 0;
+		for (int i = 0; i < nFrames; i++){
+			// A quarter turn of the benchmark orbit, bobbing up and down and looking around
+			float a = 1.5708f * i / nFrames + (i / 100) * 1.0f;
+			Camera camera(Vec3d(-5.0f * sinf(a), 0.5f * sinf(i * 0.03f), -5.0f * cosf(a)));
+			camera.fYaw = -a + 0.3f * sinf(i * 0.02f);	// Facing the model, as in Benchmark
+			camera.fPitch = 0.2f * sinf(i * 0.05f);
+
+			auto tFull = std::chrono::steady_clock::now();
+			full.Render(camera, mesh, fullList);
+			auto tCached = std::chrono::steady_clock::now();
+			cache.Render(cached, camera, mesh, cachedList);
+			auto tEnd = std::chrono::steady_clock::now();
+			fullTime += std::chrono::duration<double>(tCached - tFull).count();
+			cachedTime += std::chrono::duration<double>(tEnd - tCached).count();
+
+			if (fullList.triangles != cachedList.triangles || fullList.colours != cachedList.colours){
+				if (nMismatches++ == 0)
+					std::cerr << "   frame " << i << " differs: " << fullList.triangles.size() << " triangles drawn in full, "
+						<< cachedList.triangles.size() << " with the cache" << std::endl;
+			}
+			nFacingChecks += cache.nFacingChecks;
+			nViewChecks += cache.nViewChecks;
+			nCulled += cache.nCulled;
+		}
+
+		double clusterFrames = (double)cache.nClusters * nFrames / 100.0;
+		std::cout << "== " << sFilename << ": " << mesh.tris.size() << " triangles in " << cache.nClusters << " clusters, full "
+			<< fullTime * 1000.0 / nFrames << " ms/frame, cached " << cachedTime * 1000.0 / nFrames << " ms/frame" << std::endl;
+		std::cout << "   per frame " << (int)(nFacingChecks / clusterFrames) << "% of clusters tested for facing, "
+			<< (int)(nViewChecks / clusterFrames) << "% tested against the view, " << (int)(nCulled / clusterFrames) << "% culled, "
+			<< nMismatches << " of " << nFrames << " frames differ" << std::endl;
+		return nMismatches == 0;
+	}
+};
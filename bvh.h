@@ -0,0 +1,879 @@
+#pragma once
+
+#include "header.h"
+
+#include <cfloat>
+#include <cstdint>
+
+// A ray from origin along dir, hits are only reported for 0 < t < tMax.
+// dir does not need to be normalised, t is measured in multiples of it
+class Ray {
+public:
+	Vec3d origin;
+	Vec3d dir;
+	float tMax = FLT_MAX;
+
+	Ray() = default;
+	Ray(Vec3d origin, Vec3d dir, float tMax = FLT_MAX) : origin(origin), dir(dir), tMax(tMax) {}
+};
+
+class RayHit {
+public:
+	float t = FLT_MAX;
+	float u = 0;	// Barycentric weights of p[1] and p[2] at the hit
+	float v = 0;
+	int tri = -1;	// Index into the mesh triangles, -1 for no hit
+};
+
+// Closest finds the nearest hit. Any stops at the first hit found, which is enough
+// for shadow and line of sight tests
+enum class RayQuery {
+	Closest,
+	Any
+};
+
+// Rays traced together through the hierarchy. They share node tests, so they should start
+// close together and point in similar directions, such as neighbouring pixels
+class RayPacket {
+public:
+	static const int size = 8;
+	Ray rays[size];
+	RayHit hits[size];
+};
+
+// Result of moving a sphere along a line, t is the fraction of the move made before contact
+class SweepHit {
+public:
+	float t = 1.0f;
+	Vec3d normal;	// Unit length, from the surface towards the sphere centre at contact
+	int tri = -1;
+};
+
+
+// Triangle as Moller-Trumbore wants it, one corner and the two edges leaving it
+class BvhTriangle {
+public:
+	float v0[3];
+	float e1[3];
+	float e2[3];
+
+	BvhTriangle() = default;
+	BvhTriangle(const Triangle &tri){
+		const Vec3d *p = tri.p;
+		v0[0] = p[0].x; v0[1] = p[0].y; v0[2] = p[0].z;
+		e1[0] = p[1].x - p[0].x; e1[1] = p[1].y - p[0].y; e1[2] = p[1].z - p[0].z;
+		e2[0] = p[2].x - p[0].x; e2[1] = p[2].y - p[0].y; e2[2] = p[2].z - p[0].z;
+	}
+};
+
+// 32 bytes. Inner nodes have count 0 and children at first and first + 1,
+// leaves hold triangles first to first + count - 1
+class BvhNode {
+public:
+	float boxMin[3];
+	uint32_t first;
+	float boxMax[3];
+	uint32_t count;
+};
+
+
+// Bounding volume hierarchy over a mesh for picking, line of sight and collision.
+// Built top down, splitting each node where the surface area heuristic estimates the
+// cheapest traversal. Triangles are stored in leaf order with their original indices,
+// and are tested from both sides. The brute force versions of each query test every
+// triangle of the mesh with the same arithmetic, as a reference for the hierarchy
+class Bvh {
+public:
+	static const int maxLeafTris = 8;
+	static const int nBins = 16;
+	static const int maxDepth = 60;		// Keeps the traversal stacks from overflowing
+
+	TrackedVector<BvhNode, MemTag::Bvh> nodes;
+	TrackedVector<BvhTriangle, MemTag::Bvh> tris;
+	TrackedVector<uint32_t, MemTag::Bvh> triIndex;	// Mesh index of each entry in tris
+
+	bool Empty() const { return tris.empty(); }
+
+	void Build(const Mesh &mesh){
+		nodes.clear();
+		tris.clear();
+		triIndex.clear();
+		size_t n = mesh.tris.size();
+		if (n == 0)
+			return;
+
+		// Bounds and centre of every triangle, sorted into leaves through order
+		refs.resize(n);
+		order.resize(n);
+		for (size_t i = 0; i < n; i++){
+			const Triangle &tri = mesh.tris[i];
+			Ref &r = refs[i];
+			for (int a = 0; a < 3; a++){
+				r.boxMin[a] = std::min({ Axis(tri.p[0], a), Axis(tri.p[1], a), Axis(tri.p[2], a) });
+				r.boxMax[a] = std::max({ Axis(tri.p[0], a), Axis(tri.p[1], a), Axis(tri.p[2], a) });
+				r.centre[a] = 0.5f * (r.boxMin[a] + r.boxMax[a]);
+			}
+			order[i] = (uint32_t)i;
+		}
+
+		nodes.reserve(2 * n);
+		nodes.push_back(BvhNode());
+		Subdivide(0, 0, (uint32_t)n, 0);
+
+		tris.reserve(n);
+		triIndex.reserve(n);
+		for (uint32_t i : order){
+			tris.push_back(BvhTriangle(mesh.tris[i]));
+			triIndex.push_back(i);
+		}
+
+		refs.clear();
+		refs.shrink_to_fit();
+		order.clear();
+		order.shrink_to_fit();
+	}
+
+	// Returns true if anything was hit, hit holds the nearest (or for Any, the first found)
+	bool Intersect(const Ray &ray, RayHit &hit, RayQuery query = RayQuery::Closest) const {
+		hit = RayHit();
+		if (nodes.empty())
+			return false;
+
+		float o[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+		float d[3] = { ray.dir.x, ray.dir.y, ray.dir.z };
+		float inv[3] = { 1.0f / d[0], 1.0f / d[1], 1.0f / d[2] };
+		float tMax = ray.tMax;
+
+		uint32_t stack[64];
+		int nStack = 0;
+		uint32_t node = 0;
+		if (EnterBox(nodes[0], o, inv, tMax) == FLT_MAX)
+			return false;
+
+		while (true){
+			const BvhNode &nd = nodes[node];
+			if (nd.count > 0){
+				for (uint32_t i = nd.first; i < nd.first + nd.count; i++){
+					if (IntersectTriangle(tris[i], o, d, tMax, hit)){
+						tMax = hit.t;
+						hit.tri = (int)triIndex[i];
+						if (query == RayQuery::Any)
+							return true;
+					}
+				}
+			} else {
+				// Visit the nearer child first, so later boxes can be skipped once tMax shrinks
+				uint32_t near = nd.first, far = nd.first + 1;
+				float tNear = EnterBox(nodes[near], o, inv, tMax);
+				float tFar = EnterBox(nodes[far], o, inv, tMax);
+				if (tFar < tNear){
+					std::swap(near, far);
+					std::swap(tNear, tFar);
+				}
+				if (tNear != FLT_MAX){
+					if (tFar != FLT_MAX)
+						stack[nStack++] = far;
+					node = near;
+					continue;
+				}
+			}
+
+			// Pop until a node is still in front of the nearest hit
+			bool bFound = false;
+			while (nStack > 0){
+				node = stack[--nStack];
+				if (EnterBox(nodes[node], o, inv, tMax) != FLT_MAX){
+					bFound = true;
+					break;
+				}
+			}
+			if (!bFound)
+				break;
+		}
+		return hit.tri >= 0;
+	}
+
+	// Traces all rays of the packet. When every ray points the same way along each axis, as for
+	// neighbouring pixels, inner nodes are tested once for the whole packet against the range
+	// of its origins and directions, and rays are only tested one by one at the leaves.
+	// Otherwise each node is tested against every ray that can still reach it
+	void IntersectPacket(RayPacket &packet, RayQuery query = RayQuery::Closest) const {
+		const int N = RayPacket::size;
+		PacketRays rays;
+		for (int r = 0; r < N; r++){
+			const Ray &ray = packet.rays[r];
+			rays.o[0][r] = ray.origin.x; rays.o[1][r] = ray.origin.y; rays.o[2][r] = ray.origin.z;
+			rays.d[0][r] = ray.dir.x; rays.d[1][r] = ray.dir.y; rays.d[2][r] = ray.dir.z;
+			for (int a = 0; a < 3; a++)
+				rays.inv[a][r] = 1.0f / rays.d[a][r];
+			rays.tMax[r] = ray.tMax;
+			packet.hits[r] = RayHit();
+		}
+		if (nodes.empty())
+			return;
+
+		PacketBounds bounds;
+		if (PacketInterval(rays, bounds))
+			IntersectCoherentPacket(packet, rays, bounds, query);
+		else
+			IntersectPacketRays(packet, rays, query);
+	}
+
+	// Move a sphere of radius from one point to another and find where it first touches a
+	// triangle. A sphere that starts overlapping a triangle only collides with it when moving
+	// further in, so something resting against a surface can always slide or back away
+	bool SweepSphere(Vec3d from, Vec3d to, float radius, SweepHit &hit) const {
+		hit = SweepHit();
+		if (nodes.empty())
+			return false;
+
+		Vec3d motion = to - from;
+		float o[3] = { from.x, from.y, from.z };
+		float inv[3] = { 1.0f / motion.x, 1.0f / motion.y, 1.0f / motion.z };
+
+		uint32_t stack[64];
+		int nStack = 0;
+		stack[nStack++] = 0;
+		while (nStack > 0){
+			const BvhNode &nd = nodes[stack[--nStack]];
+
+			// The centre path against the box grown by the radius, within the move so far
+			BvhNode grown = nd;
+			for (int a = 0; a < 3; a++){
+				grown.boxMin[a] -= radius;
+				grown.boxMax[a] += radius;
+			}
+			if (EnterBox(grown, o, inv, hit.t) == FLT_MAX && !InsideBox(grown, o))
+				continue;
+
+			if (nd.count > 0){
+				for (uint32_t i = nd.first; i < nd.first + nd.count; i++){
+					if (SweepTriangle(tris[i], from, motion, radius, hit))
+						hit.tri = (int)triIndex[i];
+				}
+			} else {
+				stack[nStack++] = nd.first;
+				stack[nStack++] = nd.first + 1;
+			}
+		}
+		return hit.tri >= 0;
+	}
+
+	// Reference for Intersect, tests every triangle of the mesh
+	static bool IntersectBruteForce(const Mesh &mesh, const Ray &ray, RayHit &hit, RayQuery query = RayQuery::Closest){
+		hit = RayHit();
+		float o[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+		float d[3] = { ray.dir.x, ray.dir.y, ray.dir.z };
+		float tMax = ray.tMax;
+		for (size_t i = 0; i < mesh.tris.size(); i++){
+			if (IntersectTriangle(BvhTriangle(mesh.tris[i]), o, d, tMax, hit)){
+				tMax = hit.t;
+				hit.tri = (int)i;
+				if (query == RayQuery::Any)
+					return true;
+			}
+		}
+		return hit.tri >= 0;
+	}
+
+	// Reference for SweepSphere, tests every triangle of the mesh
+	static bool SweepSphereBruteForce(const Mesh &mesh, Vec3d from, Vec3d to, float radius, SweepHit &hit){
+		hit = SweepHit();
+		Vec3d motion = to - from;
+		for (size_t i = 0; i < mesh.tris.size(); i++){
+			if (SweepTriangle(BvhTriangle(mesh.tris[i]), from, motion, radius, hit))
+				hit.tri = (int)i;
+		}
+		return hit.tri >= 0;
+	}
+
+	// Moller-Trumbore, fills t, u and v of hit and returns true for a hit with 0 < t < tMax
+	static bool IntersectTriangle(const BvhTriangle &tri, const float o[3], const float d[3], float tMax, RayHit &hit){
+		float p[3] = { d[1] * tri.e2[2] - d[2] * tri.e2[1], d[2] * tri.e2[0] - d[0] * tri.e2[2], d[0] * tri.e2[1] - d[1] * tri.e2[0] };
+		float det = tri.e1[0] * p[0] + tri.e1[1] * p[1] + tri.e1[2] * p[2];
+		if (det > -1e-12f && det < 1e-12f)
+			return false;
+		float invDet = 1.0f / det;
+
+		float s[3] = { o[0] - tri.v0[0], o[1] - tri.v0[1], o[2] - tri.v0[2] };
+		float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+		if (u < 0.0f || u > 1.0f)
+			return false;
+
+		float q[3] = { s[1] * tri.e1[2] - s[2] * tri.e1[1], s[2] * tri.e1[0] - s[0] * tri.e1[2], s[0] * tri.e1[1] - s[1] * tri.e1[0] };
+		float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * invDet;
+		if (v < 0.0f || u + v > 1.0f)
+			return false;
+
+		float t = (tri.e2[0] * q[0] + tri.e2[1] * q[1] + tri.e2[2] * q[2]) * invDet;
+		if (t <= 0.0f || t >= tMax)
+			return false;
+
+		hit.t = t;
+		hit.u = u;
+		hit.v = v;
+		return true;
+	}
+
+	// Sphere at centre moving by motion against one triangle, updates hit if contact is
+	// earlier than hit.t. Contact is with the face, an edge or a corner, whichever comes first
+	static bool SweepTriangle(const BvhTriangle &tri, Vec3d centre, Vec3d motion, float radius, SweepHit &hit){
+		Vec3d a(tri.v0[0], tri.v0[1], tri.v0[2]);
+		Vec3d e1(tri.e1[0], tri.e1[1], tri.e1[2]);
+		Vec3d e2(tri.e2[0], tri.e2[1], tri.e2[2]);
+		Vec3d b = a + e1;
+		Vec3d c = a + e2;
+		float r2 = radius * radius;
+
+		// Already touching, collide only if moving towards the closest point
+		Vec3d closest = ClosestPointOnTriangle(centre, a, b, c);
+		Vec3d away = centre - closest;
+		float dist2 = away.dot_product(away);
+		if (dist2 < r2){
+			if (dist2 == 0.0f){
+				away = e1.cross_product(e2);
+				if (away.dot_product(motion) > 0.0f)
+					away = away * -1.0f;
+			}
+			if (away.dot_product(motion) >= 0.0f)
+				return false;
+			hit.t = 0.0f;
+			hit.normal = away.normalise();
+			return true;
+		}
+
+		bool bHit = false;
+
+		// Face, the plane pushed out by the radius towards the sphere
+		Vec3d faceNormal = e1.cross_product(e2);
+		float nLength = faceNormal.vec_length(faceNormal);
+		if (nLength > 0.0f){
+			Vec3d n = faceNormal / nLength;
+			float dist = n.dot_product(centre - a);
+			if (dist < 0.0f){
+				n = n * -1.0f;
+				dist = -dist;
+			}
+			float approach = n.dot_product(motion);
+			if (approach < 0.0f){
+				float t = (radius - dist) / approach;
+				if (t >= 0.0f && t < hit.t){
+					Vec3d contact = centre + motion * t - n * radius;
+					if (PointInTriangle(contact, a, b, c, faceNormal)){
+						hit.t = t;
+						hit.normal = n;
+						bHit = true;
+					}
+				}
+			}
+		}
+
+		// Edges, the centre path against a cylinder around each edge
+		Vec3d corners[3] = { a, b, c };
+		float mm = motion.dot_product(motion);
+		for (int i = 0; i < 3; i++){
+			Vec3d p0 = corners[i];
+			Vec3d edge = corners[(i + 1) % 3] - p0;
+			Vec3d m = centre - p0;
+			float ee = edge.dot_product(edge);
+			float me = m.dot_product(edge);
+			float de = motion.dot_product(edge);
+
+			// |(m + motion t) x edge|^2 = r^2 |edge|^2 written as A t^2 + 2 B t + C = 0
+			float A = ee * mm - de * de;
+			float B = ee * motion.dot_product(m) - de * me;
+			float C = ee * (m.dot_product(m) - r2) - me * me;
+			float t;
+			if (A > 0.0f && SmallestRoot(A, B, C, t) && t < hit.t){
+				float s = (me + de * t) / ee;
+				if (s >= 0.0f && s <= 1.0f){
+					hit.t = t;
+					hit.normal = ((centre + motion * t) - (p0 + edge * s)).normalise();
+					bHit = true;
+				}
+			}
+		}
+
+		// Corners
+		for (int i = 0; i < 3; i++){
+			Vec3d m = centre - corners[i];
+			float t;
+			if (mm > 0.0f && SmallestRoot(mm, motion.dot_product(m), m.dot_product(m) - r2, t) && t < hit.t){
+				hit.t = t;
+				hit.normal = ((centre + motion * t) - corners[i]).normalise();
+				bHit = true;
+			}
+		}
+		return bHit;
+	}
+
+private:
+	class Ref {
+	public:
+		float boxMin[3];
+		float boxMax[3];
+		float centre[3];
+	};
+
+	class Bin {
+	public:
+		float boxMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+		float boxMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		uint32_t count = 0;
+
+		void Grow(const float bMin[3], const float bMax[3]){
+			for (int a = 0; a < 3; a++){
+				boxMin[a] = std::min(boxMin[a], bMin[a]);
+				boxMax[a] = std::max(boxMax[a], bMax[a]);
+			}
+		}
+
+		float HalfArea() const {
+			if (count == 0)
+				return 0.0f;
+			float dx = boxMax[0] - boxMin[0], dy = boxMax[1] - boxMin[1], dz = boxMax[2] - boxMin[2];
+			return dx * dy + dy * dz + dz * dx;
+		}
+	};
+
+	// Build scratch
+	TrackedVector<Ref, MemTag::LoaderScratch> refs;
+	TrackedVector<uint32_t, MemTag::LoaderScratch> order;
+
+	static float Axis(const Vec3d &v, int a){
+		return a == 0 ? v.x : (a == 1 ? v.y : v.z);
+	}
+
+	void Subdivide(uint32_t nodeIdx, uint32_t first, uint32_t count, int depth){
+		Bin bounds, centres;
+		for (uint32_t i = first; i < first + count; i++){
+			const Ref &r = refs[order[i]];
+			bounds.Grow(r.boxMin, r.boxMax);
+			centres.Grow(r.centre, r.centre);
+		}
+		bounds.count = count;
+
+		BvhNode &node = nodes[nodeIdx];
+		for (int a = 0; a < 3; a++){
+			node.boxMin[a] = bounds.boxMin[a];
+			node.boxMax[a] = bounds.boxMax[a];
+		}
+		node.first = first;
+		node.count = count;
+		if (count <= 2 || depth >= maxDepth)
+			return;
+
+		// Bin the centres along each axis and cost every boundary between bins as
+		// one node visit plus the triangles on each side weighted by their box areas
+		float bestCost = FLT_MAX;
+		int bestAxis = -1, bestSplit = 0;
+		for (int a = 0; a < 3; a++){
+			float lo = centres.boxMin[a], extent = centres.boxMax[a] - lo;
+			if (extent <= 0.0f)
+				continue;
+			float scale = nBins / extent;
+
+			Bin bins[nBins];
+			for (uint32_t i = first; i < first + count; i++){
+				const Ref &r = refs[order[i]];
+				int bin = std::min(nBins - 1, (int)((r.centre[a] - lo) * scale));
+				bins[bin].count++;
+				bins[bin].Grow(r.boxMin, r.boxMax);
+			}
+
+			float leftCost[nBins - 1];
+			Bin left, right;
+			for (int i = 0; i < nBins - 1; i++){
+				if (bins[i].count > 0){
+					left.Grow(bins[i].boxMin, bins[i].boxMax);
+					left.count += bins[i].count;
+				}
+				leftCost[i] = left.HalfArea() * left.count;
+			}
+			for (int i = nBins - 1; i > 0; i--){
+				if (bins[i].count > 0){
+					right.Grow(bins[i].boxMin, bins[i].boxMax);
+					right.count += bins[i].count;
+				}
+				float cost = leftCost[i - 1] + right.HalfArea() * right.count;
+				if (cost < bestCost){
+					bestCost = cost;
+					bestAxis = a;
+					bestSplit = i;
+				}
+			}
+		}
+
+		// All centres in one place, nothing to split on
+		if (bestAxis < 0)
+			return;
+
+		float parentArea = bounds.HalfArea();
+		bestCost = 1.0f + (parentArea > 0.0f ? bestCost / parentArea : (float)count);
+		if (bestCost >= count && count <= maxLeafTris)
+			return;
+
+		float lo = centres.boxMin[bestAxis];
+		float scale = nBins / (centres.boxMax[bestAxis] - lo);
+		uint32_t *begin = order.data() + first;
+		uint32_t *mid = std::partition(begin, begin + count, [&](uint32_t i){
+			return std::min(nBins - 1, (int)((refs[i].centre[bestAxis] - lo) * scale)) < bestSplit;
+		});
+		uint32_t nLeft = (uint32_t)(mid - begin);
+		if (nLeft == 0 || nLeft == count)
+			return;
+
+		uint32_t left = (uint32_t)nodes.size();
+		nodes.push_back(BvhNode());
+		nodes.push_back(BvhNode());
+		nodes[nodeIdx].first = left;
+		nodes[nodeIdx].count = 0;
+		Subdivide(left, first, nLeft, depth + 1);
+		Subdivide(left + 1, first + nLeft, count - nLeft, depth + 1);
+	}
+
+	// Rays of a packet stored by component, so a loop over the packet works on one array at a time
+	class PacketRays {
+	public:
+		float o[3][RayPacket::size];
+		float d[3][RayPacket::size];
+		float inv[3][RayPacket::size];
+		float tMax[RayPacket::size];
+	};
+
+	// Ranges of the origins and inverse directions of a packet, for packets whose rays all
+	// point the same way along each axis
+	class PacketBounds {
+	public:
+		float oMin[3], oMax[3];
+		float invMin[3], invMax[3];
+		bool bNegative[3];
+	};
+
+	// False if the directions of the rays differ in sign, or are zero, along any axis
+	static bool PacketInterval(const PacketRays &rays, PacketBounds &b){
+		for (int a = 0; a < 3; a++){
+			b.bNegative[a] = rays.d[a][0] < 0.0f;
+			b.oMin[a] = b.oMax[a] = rays.o[a][0];
+			b.invMin[a] = b.invMax[a] = rays.inv[a][0];
+			for (int r = 0; r < RayPacket::size; r++){
+				if (rays.d[a][r] == 0.0f || (rays.d[a][r] < 0.0f) != b.bNegative[a])
+					return false;
+				b.oMin[a] = std::min(b.oMin[a], rays.o[a][r]);
+				b.oMax[a] = std::max(b.oMax[a], rays.o[a][r]);
+				b.invMin[a] = std::min(b.invMin[a], rays.inv[a][r]);
+				b.invMax[a] = std::max(b.invMax[a], rays.inv[a][r]);
+			}
+		}
+		return true;
+	}
+
+	// EnterBox for the whole packet with interval arithmetic. Returns a distance no later than
+	// any ray enters the box, or FLT_MAX if no ray can reach it before tMax. Rounding is
+	// monotonic, so the bounds hold for the rounded distances of every ray too
+	static float EnterBoxInterval(const BvhNode &node, const PacketBounds &b, float tMax){
+		float tEnter = 0.0f, tExit = tMax;
+		for (int a = 0; a < 3; a++){
+			float enter, exit;
+			if (!b.bNegative[a]){
+				float nearLo = node.boxMin[a] - b.oMax[a];
+				float farHi = node.boxMax[a] - b.oMin[a];
+				enter = nearLo * (nearLo >= 0.0f ? b.invMin[a] : b.invMax[a]);
+				exit = farHi * (farHi >= 0.0f ? b.invMax[a] : b.invMin[a]);
+			} else {
+				float nearHi = node.boxMax[a] - b.oMin[a];
+				float farLo = node.boxMin[a] - b.oMax[a];
+				enter = nearHi * (nearHi >= 0.0f ? b.invMin[a] : b.invMax[a]);
+				exit = farLo * (farLo >= 0.0f ? b.invMax[a] : b.invMin[a]);
+			}
+			tEnter = std::max(tEnter, enter);
+			tExit = std::min(tExit, exit);
+		}
+		return tEnter <= tExit ? tEnter : FLT_MAX;
+	}
+
+	// Packet traversal for rays that share direction signs. Inner nodes cost one interval test
+	// whatever the packet size. At a leaf the rays still reaching it are tested one at a time with
+	// the single ray arithmetic, so rays that miss a triangle early stop early
+	void IntersectCoherentPacket(RayPacket &packet, PacketRays &rays, const PacketBounds &bounds, RayQuery query) const {
+		const int N = RayPacket::size;
+		class Entry {
+		public:
+			uint32_t node;
+			uint32_t mask;		// Rays active when the node was pushed
+			float tEnter;		// No ray enters the node before this
+		};
+		Entry stack[64];
+		int nStack = 0;
+		uint32_t allRays = (1u << N) - 1;
+		uint32_t done = 0;	// Any queries that have already hit
+
+		float tEnterRoot = EnterBoxInterval(nodes[0], bounds, MaxT(rays, allRays));
+		if (tEnterRoot == FLT_MAX)
+			return;
+		stack[nStack++] = Entry{ 0, allRays, tEnterRoot };
+
+		while (nStack > 0){
+			Entry entry = stack[--nStack];
+			const BvhNode &nd = nodes[entry.node];
+
+			// Drop rays whose nearest hit is now in front of the box
+			uint32_t active = 0;
+			for (int r = 0; r < N; r++)
+				active |= (uint32_t)(entry.tEnter < rays.tMax[r]) << r;
+			active &= entry.mask & ~done;
+			if (active == 0)
+				continue;
+
+			if (nd.count > 0){
+				for (int r = 0; r < N; r++){
+					if (!(active >> r & 1))
+						continue;
+					float o[3] = { rays.o[0][r], rays.o[1][r], rays.o[2][r] };
+					float d[3] = { rays.d[0][r], rays.d[1][r], rays.d[2][r] };
+					float inv[3] = { rays.inv[0][r], rays.inv[1][r], rays.inv[2][r] };
+					if (EnterBox(nd, o, inv, rays.tMax[r]) == FLT_MAX)
+						continue;
+
+					RayHit &hit = packet.hits[r];
+					for (uint32_t i = nd.first; i < nd.first + nd.count; i++){
+						if (IntersectTriangle(tris[i], o, d, rays.tMax[r], hit)){
+							rays.tMax[r] = hit.t;
+							hit.tri = (int)triIndex[i];
+							if (query == RayQuery::Any){
+								done |= 1u << r;
+								break;
+							}
+						}
+					}
+				}
+				if (done == allRays)
+					return;
+			} else {
+				// Visit the child the packet reaches first first
+				float tMax = MaxT(rays, active);
+				uint32_t near = nd.first, far = nd.first + 1;
+				float tNear = EnterBoxInterval(nodes[near], bounds, tMax);
+				float tFar = EnterBoxInterval(nodes[far], bounds, tMax);
+				if (tFar < tNear){
+					std::swap(near, far);
+					std::swap(tNear, tFar);
+				}
+				if (tFar != FLT_MAX)
+					stack[nStack++] = Entry{ far, active, tFar };
+				if (tNear != FLT_MAX)
+					stack[nStack++] = Entry{ near, active, tNear };
+			}
+		}
+	}
+
+	static float MaxT(const PacketRays &rays, uint32_t mask){
+		float tMax = 0.0f;
+		for (int r = 0; r < RayPacket::size; r++){
+			if (mask >> r & 1)
+				tMax = std::max(tMax, rays.tMax[r]);
+		}
+		return tMax;
+	}
+
+	// Packet traversal testing each node against every ray still able to reach it in one
+	// loop over the packet, written so the compiler can vectorise it
+	void IntersectPacketRays(RayPacket &packet, PacketRays &rays, RayQuery query) const {
+		const int N = RayPacket::size;
+		// Nodes waiting to be visited with the rays that reach them and where they enter.
+		// Bit r of a mask is set while ray r may still hit something in the node
+		class Entry {
+		public:
+			uint32_t node;
+			uint32_t mask;
+			float tEnter[N];
+		};
+		Entry stack[64];
+		int nStack = 0;
+		stack[0].node = 0;
+		stack[0].mask = EnterBoxPacket(nodes[0], rays, stack[0].tEnter);
+		nStack++;
+		uint32_t allRays = (1u << N) - 1;
+		uint32_t done = 0;	// Any queries that have already hit
+
+		while (nStack > 0){
+			const Entry &entry = stack[--nStack];
+			const BvhNode &nd = nodes[entry.node];
+
+			// Drop rays whose nearest hit is now in front of the box
+			uint32_t active = 0;
+			for (int r = 0; r < N; r++)
+				active |= (uint32_t)(entry.tEnter[r] < rays.tMax[r]) << r;
+			active &= entry.mask & ~done;
+			if (active == 0)
+				continue;
+
+			if (nd.count > 0){
+				for (uint32_t i = nd.first; i < nd.first + nd.count; i++){
+					uint32_t hits = IntersectTrianglePacket(tris[i], rays, active, packet.hits);
+					for (int r = 0; r < N; r++){
+						if (hits >> r & 1)
+							packet.hits[r].tri = (int)triIndex[i];
+					}
+					if (query == RayQuery::Any){
+						active &= ~hits;
+						done |= hits;
+					}
+				}
+				if (done == allRays)
+					return;
+			} else {
+				// Push both children, the one most active rays reach first goes on top
+				Entry left, right;
+				left.node = nd.first;
+				right.node = nd.first + 1;
+				left.mask = EnterBoxPacket(nodes[left.node], rays, left.tEnter) & active;
+				right.mask = EnterBoxPacket(nodes[right.node], rays, right.tEnter) & active;
+				int nLeftFirst = 0, nActive = 0;
+				for (int r = 0; r < N; r++){
+					nLeftFirst += (active >> r & 1) && left.tEnter[r] <= right.tEnter[r];
+					nActive += active >> r & 1;
+				}
+				bool bLeftFirst = 2 * nLeftFirst >= nActive;
+
+				if (right.mask != 0 && bLeftFirst)
+					stack[nStack++] = right;
+				if (left.mask != 0)
+					stack[nStack++] = left;
+				if (right.mask != 0 && !bLeftFirst)
+					stack[nStack++] = right;
+			}
+		}
+	}
+
+
+	// EnterBox for every ray in the packet, returns the mask of rays that reach the box
+	static uint32_t EnterBoxPacket(const BvhNode &node, const PacketRays &rays, float tEnter[RayPacket::size]){
+		const int N = RayPacket::size;
+		int reached[N];
+		for (int r = 0; r < N; r++){
+			float enter = 0.0f, exit = rays.tMax[r];
+			for (int a = 0; a < 3; a++){
+				float t1 = (node.boxMin[a] - rays.o[a][r]) * rays.inv[a][r];
+				float t2 = (node.boxMax[a] - rays.o[a][r]) * rays.inv[a][r];
+				enter = std::max(enter, std::min(t1, t2));
+				exit = std::min(exit, std::max(t1, t2));
+			}
+			reached[r] = enter <= exit;
+			tEnter[r] = reached[r] ? enter : FLT_MAX;
+		}
+		uint32_t mask = 0;
+		for (int r = 0; r < N; r++)
+			mask |= (uint32_t)reached[r] << r;
+		return mask;
+	}
+
+	// IntersectTriangle for the active rays of a packet, returns the mask of rays that hit.
+	// Every ray is computed and the results kept only where they count, the arithmetic is the
+	// same as IntersectTriangle so both give identical hits
+	static uint32_t IntersectTrianglePacket(const BvhTriangle &tri, PacketRays &rays, uint32_t active, RayHit hits[RayPacket::size]){
+		const int N = RayPacket::size;
+		float tOut[N], uOut[N], vOut[N];
+		int bHit[N];
+		for (int r = 0; r < N; r++){
+			float d0 = rays.d[0][r], d1 = rays.d[1][r], d2 = rays.d[2][r];
+			float p0 = d1 * tri.e2[2] - d2 * tri.e2[1], p1 = d2 * tri.e2[0] - d0 * tri.e2[2], p2 = d0 * tri.e2[1] - d1 * tri.e2[0];
+			float det = tri.e1[0] * p0 + tri.e1[1] * p1 + tri.e1[2] * p2;
+			float invDet = 1.0f / det;
+
+			float s0 = rays.o[0][r] - tri.v0[0], s1 = rays.o[1][r] - tri.v0[1], s2 = rays.o[2][r] - tri.v0[2];
+			float u = (s0 * p0 + s1 * p1 + s2 * p2) * invDet;
+
+			float q0 = s1 * tri.e1[2] - s2 * tri.e1[1], q1 = s2 * tri.e1[0] - s0 * tri.e1[2], q2 = s0 * tri.e1[1] - s1 * tri.e1[0];
+			float v = (d0 * q0 + d1 * q1 + d2 * q2) * invDet;
+			float t = (tri.e2[0] * q0 + tri.e2[1] * q1 + tri.e2[2] * q2) * invDet;
+
+			bHit[r] = !(det > -1e-12f && det < 1e-12f) && u >= 0.0f && u <= 1.0f && v >= 0.0f && u + v <= 1.0f
+				&& t > 0.0f && t < rays.tMax[r];
+			tOut[r] = t;
+			uOut[r] = u;
+			vOut[r] = v;
+		}
+
+		uint32_t mask = 0;
+		for (int r = 0; r < N; r++){
+			if ((active >> r & 1) && bHit[r]){
+				hits[r].t = tOut[r];
+				hits[r].u = uOut[r];
+				hits[r].v = vOut[r];
+				rays.tMax[r] = tOut[r];
+				mask |= 1u << r;
+			}
+		}
+		return mask;
+	}
+
+	// Distance along the ray where it enters the box, FLT_MAX if it misses or enters after tMax
+	static float EnterBox(const BvhNode &node, const float o[3], const float inv[3], float tMax){
+		float tEnter = 0.0f, tExit = tMax;
+		for (int a = 0; a < 3; a++){
+			float t1 = (node.boxMin[a] - o[a]) * inv[a];
+			float t2 = (node.boxMax[a] - o[a]) * inv[a];
+			tEnter = std::max(tEnter, std::min(t1, t2));
+			tExit = std::min(tExit, std::max(t1, t2));
+		}
+		return tEnter <= tExit ? tEnter : FLT_MAX;
+	}
+
+	static bool InsideBox(const BvhNode &node, const float p[3]){
+		for (int a = 0; a < 3; a++){
+			if (p[a] < node.boxMin[a] || p[a] > node.boxMax[a])
+				return false;
+		}
+		return true;
+	}
+
+	// Smaller t >= 0 of A t^2 + 2 B t + C = 0, the sphere is known to start outside
+	static bool SmallestRoot(float A, float B, float C, float &t){
+		float disc = B * B - A * C;
+		if (disc < 0.0f)
+			return false;
+		t = (-B - sqrtf(disc)) / A;
+		return t >= 0.0f;
+	}
+
+	// p on the plane of the triangle, n is (b - a) x (c - a)
+	static bool PointInTriangle(Vec3d p, Vec3d a, Vec3d b, Vec3d c, Vec3d n){
+		return (b - a).cross_product(p - a).dot_product(n) >= 0.0f
+			&& (c - b).cross_product(p - b).dot_product(n) >= 0.0f
+			&& (a - c).cross_product(p - c).dot_product(n) >= 0.0f;
+	}
+
+	// From Real-Time Collision Detection, checks the Voronoi regions of the corners and edges
+	static Vec3d ClosestPointOnTriangle(Vec3d p, Vec3d a, Vec3d b, Vec3d c){
+		Vec3d ab = b - a, ac = c - a, ap = p - a;
+		float d1 = ab.dot_product(ap), d2 = ac.dot_product(ap);
+		if (d1 <= 0.0f && d2 <= 0.0f)
+			return a;
+
+		Vec3d bp = p - b;
+		float d3 = ab.dot_product(bp), d4 = ac.dot_product(bp);
+		if (d3 >= 0.0f && d4 <= d3)
+			return b;
+
+		float vc = d1 * d4 - d3 * d2;
+		if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+			return a + ab * (d1 / (d1 - d3));
+
+		Vec3d cp = p - c;
+		float d5 = ab.dot_product(cp), d6 = ac.dot_product(cp);
+		if (d6 >= 0.0f && d5 <= d6)
+			return c;
+
+		float vb = d5 * d2 - d1 * d6;
+		if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+			return a + ac * (d2 / (d2 - d6));
+
+		float va = d3 * d6 - d5 * d4;
+		if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+			return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+		float denom = 1.0f / (va + vb + vc);
+		return a + ab * (vb * denom) + ac * (vc * denom);
+	}
+};
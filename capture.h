@@ -0,0 +1,216 @@
+#pragma once
+
+#include "raster.h"
+#include "queue.h"
+
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <iomanip>
+
+// Records finished frames to numbered image files without holding up the render loop.
+// Frames are read back into a fixed ring of frame buffers and an encoder thread writes them out.
+// On the GL path the read goes through pixel buffer objects and is collected a few frames later,
+// so the render thread never waits for the GPU. If the encoder falls behind and no buffer is free
+// the frame is dropped and counted, and the missing number shows as a gap in the file names
+class FrameCapture {
+public:
+	int ringSize = 8;		// Frame buffers shared between readback and the encoder
+	static const int nPbos = 3;	// Frames in flight on the GPU before they are collected
+	bool bUsePbos = true;	// Cleared if GLEW did not load, the buffer functions are then missing
+
+	// Counters, frames are numbered from 0 in the order they were offered
+	std::atomic<uint64_t> nWritten{ 0 };
+	std::atomic<uint64_t> nFailed{ 0 };
+	uint64_t nFrames = 0;
+	uint64_t nDropped = 0;
+	double totalOverheadMs = 0;		// Render thread time spent in CaptureGL
+	double maxOverheadMs = 0;
+
+	~FrameCapture(){ Stop(); }
+
+	bool IsRunning() const { return bRunning; }
+
+	// extension is ".png" or ".ppm" (raw RGB with a short header)
+	bool Start(int w, int h, std::string dir, std::string ext){
+		Stop();
+		width = w;
+		height = h;
+		outDir = dir;
+		extension = ext;
+		nWritten = 0;
+		nFailed = 0;
+		nFrames = 0;
+		nDropped = 0;
+		totalOverheadMs = 0;
+		maxOverheadMs = 0;
+
+		freeBuffers.reset(new BoundedQueue<std::unique_ptr<FrameBuffer>>(ringSize));
+		encodeQueue.reset(new BoundedQueue<Job>(ringSize));
+		for (int i = 0; i < ringSize; i++)
+			freeBuffers->Push(std::unique_ptr<FrameBuffer>(new FrameBuffer(width, height)));
+
+		encoder = std::thread([this]{ EncodeLoop(); });
+		bRunning = true;
+		return true;
+	}
+
+	// Stop capturing, collect any frames still on the GPU and wait for the encoder to finish
+	void Stop(){
+		if (!bRunning)
+			return;
+
+		if (bPbosReady){
+			for (int i = 0; i < nPbos; i++){
+				int idx = (pboNext + i) % nPbos;
+				if (pboFrame[idx] >= 0)
+					CollectPbo(idx);
+			}
+			glDeleteBuffers(nPbos, pbos);
+			bPbosReady = false;
+		}
+
+		encodeQueue->Close();
+		encoder.join();
+		bRunning = false;
+		Report(std::cout);
+	}
+
+	// Read back the current GL back buffer, call after drawing and before swapping
+	void CaptureGL(){
+		if (!bRunning)
+			return;
+		auto tStart = std::chrono::steady_clock::now();
+
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadBuffer(GL_BACK);
+
+		if (!bPbosReady && bUsePbos && GLEW_ARB_pixel_buffer_object){
+			glGenBuffers(nPbos, pbos);
+			for (int i = 0; i < nPbos; i++){
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+				glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 3, NULL, GL_STREAM_READ);
+				pboFrame[i] = -1;
+			}
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			bPbosReady = true;
+		}
+
+		if (bPbosReady){
+			// Collect the oldest read, which has had nPbos - 1 frames to complete, then reuse its buffer
+			int idx = pboNext;
+			if (pboFrame[idx] >= 0)
+				CollectPbo(idx);
+
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[idx]);
+			glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			pboFrame[idx] = (int64_t)nFrames++;
+			pboNext = (pboNext + 1) % nPbos;
+		} else {
+			// No pixel buffer objects, read straight into a ring buffer
+			uint64_t frame = nFrames++;
+			std::unique_ptr<FrameBuffer> fb;
+			if (TakeBuffer(fb)){
+				glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, fb->pixels.data());
+				encodeQueue->Push(Job{ frame, std::move(fb) });
+			}
+		}
+
+		AddOverhead(tStart);
+	}
+
+	double AverageOverheadMs() const {
+		return nFrames == 0 ? 0.0 : totalOverheadMs / nFrames;
+	}
+
+	void Report(std::ostream &out) const {
+		out << "capture: " << nFrames << " frames, " << nWritten << " written, " << nDropped << " dropped, "
+			<< nFailed << " failed, overhead " << AverageOverheadMs() << " ms/frame average, " << maxOverheadMs << " ms max" << std::endl;
+	}
+
+private:
+	class Job {
+	public:
+		uint64_t frame = 0;
+		std::unique_ptr<FrameBuffer> fb;
+	};
+
+	int width = 0;
+	int height = 0;
+	std::string outDir;
+	std::string extension;
+	bool bRunning = false;
+
+	std::unique_ptr<BoundedQueue<std::unique_ptr<FrameBuffer>>> freeBuffers;
+	std::unique_ptr<BoundedQueue<Job>> encodeQueue;
+	std::thread encoder;
+
+	GLuint pbos[nPbos];
+	int64_t pboFrame[nPbos];	// Frame number waiting in each pixel buffer, -1 if none
+	int pboNext = 0;
+	bool bPbosReady = false;
+
+	// A free ring buffer, or false and a dropped frame if the encoder has them all
+	bool TakeBuffer(std::unique_ptr<FrameBuffer> &fb){
+		if (!freeBuffers->TryPop(fb)){
+			nDropped++;
+			return false;
+		}
+		return true;
+	}
+
+	void CollectPbo(int idx){
+		uint64_t frame = (uint64_t)pboFrame[idx];
+		pboFrame[idx] = -1;
+
+		std::unique_ptr<FrameBuffer> fb;
+		if (!TakeBuffer(fb))
+			return;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[idx]);
+		const uint8_t *src = (const uint8_t*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+		if (src){
+			std::copy(src, src + fb->pixels.size(), fb->pixels.begin());
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		if (src)
+			encodeQueue->Push(Job{ frame, std::move(fb) });
+		else
+			freeBuffers->Push(std::move(fb));
+	}
+
+	void AddOverhead(std::chrono::steady_clock::time_point tStart){
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - tStart;
+		totalOverheadMs += elapsed.count();
+		maxOverheadMs = std::max(maxOverheadMs, elapsed.count());
+	}
+
+	void EncodeLoop(){
+		Job job;
+		while (encodeQueue->Pop(job)){
+			// OpenGL rows start at the bottom of the picture
+			size_t rowBytes = (size_t)width * 3;
+			for (int y = 0; y < height / 2; y++)
+				std::swap_ranges(job.fb->pixels.begin() + y * rowBytes, job.fb->pixels.begin() + (y + 1) * rowBytes,
+					job.fb->pixels.begin() + (height - 1 - y) * rowBytes);
+
+			std::stringstream s;
+			s << outDir << "/capture_" << std::setw(6) << std::setfill('0') << job.frame << extension;
+			try {
+				if (ImageWriter::Write(s.str(), *job.fb)){
+					nWritten++;
+				} else if (nFailed++ == 0){
+					std::cerr << "Failed to write " << s.str() << std::endl;
+				}
+			} catch (const std::bad_alloc &) {
+				// Over --mem-cap, count the frame as failed and carry on with the next
+				if (nFailed++ == 0)
+					std::cerr << "Out of memory writing " << s.str() << std::endl;
+			}
+			freeBuffers->Push(std::move(job.fb));
+		}
+	}
+};
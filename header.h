@@ -10,10 +10,13 @@
 #include <vector>
 #include <array>
 #include <list>
+#include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "memory.h"
+
 class Mat4;
 
 class Vec3d{
@@ -80,7 +83,7 @@ public:
 
 class Mesh {
 public:
-	std::vector<Triangle> tris;
+	TrackedVector<Triangle, MemTag::Mesh> tris;
 
 	bool LoadFromObjectFile(std::string sFilename)
 	{
@@ -89,7 +92,7 @@ public:
 			return false;
 
 		// Local cache of verts
-		std::vector<Vec3d> verts;
+		TrackedVector<Vec3d, MemTag::LoaderScratch> verts;
 
 		while (!f.eof())
 		{
@@ -275,4 +278,55 @@ public:
 		Mat4 matCamera = Mat4::pointAt(pos, vTarget, { 0,1,0 });
 		return matCamera.quickInverse();
 	}
-};
\ No newline at end of file
+};
+
+
+// The six planes of a camera's view volume in world space, normals point inwards
+class Frustum {
+public:
+	Vec3d n[6];
+	float d[6];
+
+	// Matches Mat4::makeProjection, fFovDegrees is the vertical field of view and
+	// fAspectRatio is height / width as passed to the projection
+	static Frustum fromCamera(Camera &camera, float fFovDegrees, float fAspectRatio, float fNear, float fFar){
+		Vec3d forward = camera.lookDir.normalise();
+		Vec3d up = Vec3d(0, 1, 0);
+		up = up - forward * up.dot_product(forward);
+		up = up.normalise();
+		Vec3d right = up.cross_product(forward);
+
+		float tanV = tanf(fFovDegrees * 0.5f / 180.0f * 3.14159f);
+		float tanH = tanV / fAspectRatio;
+
+		Frustum f;
+		f.n[0] = forward;
+		f.n[1] = forward * -1.0f;
+		f.n[2] = (right + forward * tanH).normalise();
+		f.n[3] = (right * -1.0f + forward * tanH).normalise();
+		f.n[4] = (up + forward * tanV).normalise();
+		f.n[5] = (up * -1.0f + forward * tanV).normalise();
+
+		Vec3d pos = camera.pos;
+		Vec3d nearPoint = pos + forward * fNear;
+		Vec3d farPoint = pos + forward * fFar;
+		f.d[0] = -f.n[0].dot_product(nearPoint);
+		f.d[1] = -f.n[1].dot_product(farPoint);
+		for (int i = 2; i < 6; i++)
+			f.d[i] = -f.n[i].dot_product(pos);
+		return f;
+	}
+
+	// False only if the box is entirely outside one of the planes
+	bool intersectsBox(const Vec3d &boxMin, const Vec3d &boxMax) const {
+		for (int i = 0; i < 6; i++){
+			// Corner furthest along the plane normal
+			float px = n[i].x >= 0 ? boxMax.x : boxMin.x;
+			float py = n[i].y >= 0 ? boxMax.y : boxMin.y;
+			float pz = n[i].z >= 0 ? boxMax.z : boxMin.z;
+			if (n[i].x * px + n[i].y * py + n[i].z * pz + d[i] < 0.0f)
+				return false;
+		}
+		return true;
+	}
+};
@@ -61,6 +61,15 @@ Last Update: 25/04/2024
 */
 
 #include "header.h"
+#include "pipeline.h"
+#include "batch.h"
+#include "bench.h"
+#include "pointcloud.h"
+#include "terrain.h"
+#include "paging.h"
+#include "capture.h"
+#include "bvh.h"
+#include "visibility.h"
 
 
 using namespace std;
@@ -69,148 +78,115 @@ void errorCallback(int error, const char* description) {
   	std::cerr << "Error: " << description << std::endl;
 }
 
+// Settings for the interactive viewer taken from the command line
+class ViewerOptions {
+public:
+	size_t pointBudget = 0;			// Points per frame for point clouds, 0 keeps the default
+	bool bPoints = false;			// Draw the vertices of any obj file as a point cloud
+	float pointCloudFaceRatio = 0.1f;	// Files with fewer faces per vertex than this are point clouds
+	bool bDetectTerrain = true;		// Draw heightfield meshes with the chunked terrain renderer
+	float heightmapSpacing = 1.0f;	// Distance between .pgm heightmap samples
+	float heightmapHeight = 64.0f;	// Height of a full white .pgm sample
+	size_t pageBudgetMB = 256;		// Page cache size for .pages files
+	std::string captureDir;			// Record frames here from the start, empty to wait for the C key
+	std::string captureExtension = ".png";
+	float collisionRadius = 0.25f;	// Size of the camera for collision with meshes, 0 to fly through them
+	bool bVisibilityCache = true;	// Keep backface and view results between frames for meshes
+};
+
 class GameEngine3D{
 private:
 	Mesh meshCube;
-	Mat4 matProj;	// Matrix that converts from view space to screen space
+	Pipeline pipeline;	// Transforms, clips and projects the mesh into drawList
+	DrawList drawList;
+	PointCloud cloud;	// Used instead of meshCube when the file has few or no faces
+	PointSplatter splatter;
+	bool bPointCloud = false;
+	Terrain terrain;	// Used instead of meshCube for heightfields and .pgm heightmaps
+	TrackedVector<Triangle, MemTag::ClipScratch> terrainTris;
+	bool bTerrain = false;
+	PagedMesh pagedMesh;	// Used instead of meshCube for out of core .pages files
+	bool bPaged = false;
+	Bvh bvh;	// Picking and camera collision against meshCube
+	VisibilityCache visibility;	// Renders meshCube re-testing only what the camera move could change
+	FrameCapture capture;	// Writes finished frames to captureDir while recording
+	ViewerOptions options;
 	Camera camera = Camera(Vec3d(0, 0, -5));
 	int windowWidth;
 	int windowHeight;
 	GLFWwindow* window;
 	std::string filename;
 
-	Vec3d Vector_IntersectPlane(Vec3d &plane_p, Vec3d &plane_n, Vec3d &lineStart, Vec3d &lineEnd){
-		plane_n = plane_n.normalise();
-		float plane_d = -plane_n.dot_product(plane_p);
-		float ad = lineStart.dot_product(plane_n);
-		float bd = lineEnd.dot_product(plane_n);
-		float t = (-plane_d - ad) / (bd - ad);
-		Vec3d lineStartToEnd = lineEnd - lineStart;
-		Vec3d lineToIntersect = lineStartToEnd * t;
-		return lineStart + lineToIntersect;
+	void drawTriangle(const DrawList &list){
+		for(int i = 0; i < (int) list.triangles.size(); i++){
+			glColor3f(list.colours[i], list.colours[i], list.colours[i]);
+			glVertexPointer(3, GL_FLOAT, 0, &list.triangles[i]);
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+		}
 	}
 
-	int Triangle_ClipAgainstPlane(Vec3d plane_p, Vec3d plane_n, Triangle &in_tri, Triangle &out_tri1, Triangle &out_tri2){
-		// Make sure plane normal is indeed normal
-		plane_n = plane_n.normalise();
-
-		// Return signed shortest distance from point to plane, plane normal must be normalised
-		auto dist = [&](Vec3d &p)
-		{
-			//Vec3d n = Vector_Normalise(p);
-			return (plane_n.x * p.x + plane_n.y * p.y + plane_n.z * p.z - plane_n.dot_product(plane_p));
-		};
-
-		// Create two temporary storage arrays to classify points either side of plane
-		// If distance sign is positive, point lies on "inside" of plane
-		Vec3d* inside_points[3];  int nInsidePointCount = 0;
-		Vec3d* outside_points[3]; int nOutsidePointCount = 0;
-
-		// Get signed distance of each point in Triangle to plane
-		float d0 = dist(in_tri.p[0]);
-		float d1 = dist(in_tri.p[1]);
-		float d2 = dist(in_tri.p[2]);
-
-		if (d0 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[0]; }
-		else { outside_points[nOutsidePointCount++] = &in_tri.p[0]; }
-		if (d1 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[1]; }
-		else { outside_points[nOutsidePointCount++] = &in_tri.p[1]; }
-		if (d2 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[2]; }
-		else { outside_points[nOutsidePointCount++] = &in_tri.p[2]; }
-
-		// Now classify Triangle points, and break the input Triangle into 
-		// smaller output triangles if required. There are four possible
-		// outcomes...
-
-		if (nInsidePointCount == 0)
-		{
-			// All points lie on the outside of plane, so clip whole Triangle
-			// It ceases to exist
-
-			return 0; // No returned triangles are valid
+	bool GraphicsInit(){
+		// Out of core models are paged in as they come into view
+		if (filename.size() >= 6 && filename.compare(filename.size() - 6, 6, ".pages") == 0){
+			pagedMesh.budgetBytes = options.pageBudgetMB << 20;
+			if (!pagedMesh.Open(filename)){
+				std::cerr << "Failed to open page file " << filename << std::endl;
+				return false;
+			}
+			bPaged = true;
 		}
-
-		if (nInsidePointCount == 3)
-		{
-			// All points lie on the inside of plane, so do nothing
-			// and allow the Triangle to simply pass through
-			out_tri1 = in_tri;
-
-			return 1; // Just the one returned original Triangle is valid
+		// Raw heightmaps go straight to the terrain renderer
+		else if (filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".pgm") == 0){
+			Heightfield field;
+			if (!field.LoadFromPGM(filename, options.heightmapSpacing, options.heightmapHeight)){
+				std::cerr << "Failed to load heightmap " << filename << std::endl;
+				return false;
+			}
+			terrain.Build(std::move(field));
+			bTerrain = true;
+		} else {
+			// Scan data often has few or no faces, show the vertices as a point cloud instead.
+			// Counting lines first means only one of the loaders parses the file
+			size_t nVerts, nFaces;
+			PointCloud::CountObjElements(filename, nVerts, nFaces);
+			if (options.bPoints || (nVerts > 0 && nFaces < nVerts * options.pointCloudFaceRatio)){
+				bPointCloud = cloud.LoadFromObjectFile(filename) && !cloud.points.empty();
+			} else {
+				// Load object file
+				meshCube.LoadFromObjectFile(filename);
+
+				// Height grids such as mountains.obj are resampled into terrain tiles
+				Heightfield field;
+				if (options.bDetectTerrain && Heightfield::FromMesh(meshCube, field)){
+					terrain.Build(std::move(field));
+					bTerrain = true;
+					meshCube.tris.clear();
+					meshCube.tris.shrink_to_fit();
+				}
+			}
 		}
 
-		if (nInsidePointCount == 1 && nOutsidePointCount == 2)
-		{
-			// Triangle should be clipped. As two points lie outside
-			// the plane, the Triangle simply becomes a smaller Triangle
-
-			// Copy appearance info to new Triangle
-			out_tri1.col =  in_tri.col;
-
-			// The inside point is valid, so keep that...
-			out_tri1.p[0] = *inside_points[0];
-
-			// but the two new points are at the locations where the 
-			// original sides of the Triangle (lines) intersect with the plane
-			out_tri1.p[1] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[0], *outside_points[0]);
-			out_tri1.p[2] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[0], *outside_points[1]);
-
-			return 1; // Return the newly formed single Triangle
+		// Only whole meshes are held in memory for ray queries
+		if (!meshCube.tris.empty()){
+			bvh.Build(meshCube);
 		}
 
-		if (nInsidePointCount == 2 && nOutsidePointCount == 1)
-		{
-			// Triangle should be clipped. As two points lie inside the plane,
-			// the clipped Triangle becomes a "quad". Fortunately, we can
-			// represent a quad with two new triangles
-
-			// Copy appearance info to new triangles
-			out_tri1.col =  in_tri.col;
-
-			out_tri2.col =  in_tri.col;
-
-			// The first Triangle consists of the two inside points and a new
-			// point determined by the location where one side of the Triangle
-			// intersects with the plane
-			out_tri1.p[0] = *inside_points[0];
-			out_tri1.p[1] = *inside_points[1];
-			out_tri1.p[2] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[0], *outside_points[0]);
-
-			// The second Triangle is composed of one of he inside points, a
-			// new point determined by the intersection of the other side of the 
-			// Triangle and the plane, and the newly created point above
-			out_tri2.p[0] = *inside_points[1];
-			out_tri2.p[1] = out_tri1.p[2];
-			out_tri2.p[2] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[1], *outside_points[0]);
-
-			return 2; // Return two newly formed triangles which form a quad
+		if (options.pointBudget > 0){
+			splatter.pointsPerFrame = options.pointBudget;
 		}
-		return 0;
-	}
 
-	void drawTriangle(vector<array<float, 9>> triangles, vector<float> colours){
-		for(int i = 0; i < (int) triangles.size(); i++){
-			glColor3f(colours[i], colours[i], colours[i]);
-			glVertexPointer(3, GL_FLOAT, 0, &triangles[i]);
-			glDrawArrays(GL_TRIANGLES, 0, 3);
-		}
-	}
-
-	bool GraphicsInit(){
-		// Load object file
-		meshCube.LoadFromObjectFile(filename);
-
-		// Projection Matrix
-		matProj = Mat4::makeProjection(90.0f, (float)windowHeight / (float)windowWidth, 0.1f, 1000.0f);
+		// Projection Matrix lives in the pipeline
+		pipeline = Pipeline(windowWidth, windowHeight);
 		return true;
 	}
 
 
 public:
-	GameEngine3D(int w, int h, string _filename){
+	GameEngine3D(int w, int h, string _filename, ViewerOptions _options = ViewerOptions()){
 		windowWidth = w;
 		windowHeight = h;
 		filename = _filename;
+		options = _options;
 
 		// Initialize GLFW
 		if (!glfwInit()) {
@@ -232,6 +208,12 @@ public:
 		// Make the window's context current
 		glfwMakeContextCurrent(window);
 
+		// Extensions such as pixel buffer objects used by frame capture. Drawing needs none of
+		// them, so without GLEW capture falls back to plain reads
+		if (glewInit() != GLEW_OK) {
+			std::cerr << "Failed to initialize GLEW, recording will not use pixel buffer objects" << std::endl;
+			capture.bUsePbos = false;
+		}
 		
 		// Create user resources as part of this thread
 		if (!GraphicsInit()){
@@ -240,169 +222,101 @@ public:
 		}
 	}
 
-	bool Render(float fElapsedTime){
-		Mat4 matWorld = Mat4::makeIdentity();	// Form World Matrix
-
-		// Get view matrix from camera class
-		Mat4 matView = camera.matView();
-
-		// Store triagles for rastering later
-		vector<Triangle> vecTrianglesToClip;
-		vector<array<float, 9>> trianglesToDraw;
-		vector<float> coloursToDraw;
-
-		// Draw Triangles
-		for (auto tri : meshCube.tris){
-			Triangle triProjected, triTransformed, triViewed;
+	// Move the camera from its last position towards camera.pos, stopping at the mesh and
+	// sliding along it. Each slide drops the part of the move going into the surface
+	void MoveCamera(Vec3d from){
+		Vec3d to = camera.pos;
+		camera.pos = from;
+		if (bvh.Empty() || options.collisionRadius <= 0.0f){
+			camera.pos = to;
+			return;
+		}
 
-			// World Matrix Transform
-			for(int i = 0; i < 3; i++){
-				triTransformed.p[i] = matWorld * tri.p[i];
+		for (int i = 0; i < 3; i++){
+			SweepHit hit;
+			if (!bvh.SweepSphere(camera.pos, to, options.collisionRadius, hit)){
+				camera.pos = to;
+				return;
 			}
 
-			// Calculate Triangle Normal
-			Vec3d normal, line1, line2;
+			// Stop a little short so the next sweep does not start touching
+			Vec3d motion = to - camera.pos;
+			float length = motion.vec_length(motion);
+			float t = std::max(0.0f, hit.t - 0.001f / length);
+			camera.pos = camera.pos + motion * t;
 
-			// Get lines either side of Triangle
-			line1 = triTransformed.p[1] - triTransformed.p[0];
-			line2 = triTransformed.p[2] - triTransformed.p[0];
-
-			// Take cross product of lines to get normal to Triangle surface
-			normal = line1.cross_product(line2);
+			Vec3d remaining = to - camera.pos;
+			to = camera.pos + (remaining - hit.normal * remaining.dot_product(hit.normal));
+		}
+	}
 
-			// You normally need to normalise a normal!
-			normal = normal.normalise();
-			
-			// Get Ray from Triangle to camera
-			Vec3d vCameraRay = triTransformed.p[0] - camera.pos;
+	// Report the triangle in the middle of the screen, the mouse turns the camera so the cursor stays there
+	void Pick(){
+		RayHit hit;
+		Ray ray(camera.pos, camera.lookDir.normalise());
+		if (!bvh.Intersect(ray, hit)){
+			std::cout << "Nothing under the cursor" << std::endl;
+			return;
+		}
+		Vec3d p = ray.origin + ray.dir * hit.t;
+		std::cout << "Triangle " << hit.tri << " at distance " << hit.t << " (" << p.x << ", " << p.y << ", " << p.z << ")" << std::endl;
+	}
 
+	void StartCapture(){
+		int fbWidth, fbHeight;
+		glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
+		std::string dir = options.captureDir.empty() ? "." : options.captureDir;
+		capture.Start(fbWidth, fbHeight, dir, options.captureExtension);
+		std::cout << "Recording " << fbWidth << "x" << fbHeight << " frames to " << dir << std::endl;
+	}
 
-			// If ray is aligned with normal, then Triangle is visible
-			if (normal.dot_product(vCameraRay) < 0.0f){
-				// Illumination
-				Vec3d light_direction = { 0.0f, 1.0f, -0.5f };
-				light_direction = light_direction.normalise();
+	void drawPoints(){
+		size_t nPoints = splatter.Update(camera, pipeline.matProj, cloud);
 
-				// How "aligned" are light direction and Triangle surface normal?
-				float dp = max(0.2f, (float)(light_direction.dot_product(normal) * 1));
-				dp = min(dp, 0.85f);
+		glEnable(GL_DEPTH_TEST);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glEnableClientState(GL_COLOR_ARRAY);
+		glPointSize(2.0f);
 
-				triTransformed.col = dp;
+		glVertexPointer(3, GL_FLOAT, 0, splatter.vertices.data());
+		glColorPointer(3, GL_FLOAT, 0, splatter.colours.data());
+		glDrawArrays(GL_POINTS, 0, (int)nPoints);
 
-				// Convert World Space --> View Space
-				for(int i = 0; i < 3; i++){
-					triViewed.p[i] = matView * triTransformed.p[i];
-				}
-				triViewed.col = triTransformed.col;
-
-				// Clip Viewed Triangle against near plane, this could form two additional
-				// additional triangles. 
-				int nClippedTriangles = 0;
-				Triangle clipped[2];
-				nClippedTriangles = Triangle_ClipAgainstPlane({ 0.0f, 0.0f, 0.1f }, { 0.0f, 0.0f, 1.0f }, triViewed, clipped[0], clipped[1]);
-
-				// We may end up with multiple triangles form the clip, so project as
-				// required
-				for (int n = 0; n < nClippedTriangles; n++){
-					Vec3d vOffsetView = { 1,1,0 };
-
-					//for each point in the triangle
-					for (int i = 0; i < 3; i++){
-						// Project triangles from 3D --> 2D
-						triProjected.p[i] = matProj * clipped[n].p[i];
-
-						// Scale into view, we moved the normalising into cartesian space
-						// out of the matrix.vector function from the previous videos, so
-						// do this manually
-						triProjected.p[i] = triProjected.p[i] / triProjected.p[i].w;
-
-						// X/Y are inverted so put them back
-						triProjected.p[i].x *= -1.0f;
-						triProjected.p[i].y *= 1.0f;
-
-						// Offset verts into visible normalised space
-						triProjected.p[i] = triProjected.p[i] + vOffsetView;
-
-						// Scale into view
-						triProjected.p[i].x *= 0.5f * (float)windowWidth;
-						triProjected.p[i].y *= 0.5f * (float)windowHeight;
-					}
-					triProjected.col = clipped[n].col;
+		glDisableClientState(GL_COLOR_ARRAY);
+		glDisable(GL_DEPTH_TEST);
+	}
 
-					// Store Triangle for sorting
-					vecTrianglesToClip.push_back(triProjected);
-				}			
-			}
+	bool Render(float fElapsedTime){
+		if (bPointCloud){
+			drawPoints();
+			return true;
 		}
 
-		// Sort triangles from back to front
-		sort(vecTrianglesToClip.begin(), vecTrianglesToClip.end(), [](Triangle &t1, Triangle &t2){
-			float z1 = (t1.p[0].z + t1.p[1].z + t1.p[2].z) / 3.0f;
-			float z2 = (t2.p[0].z + t2.p[1].z + t2.p[2].z) / 3.0f;
-			return z1 > z2;
-		});
-
-
-		// Loop through all transformed, viewed, projected, and sorted triangles
-		// Clip triangles against all four screen edges and normalise to OpenGL screen coordinates
-		for (auto &triToRaster : vecTrianglesToClip){
-			// Clip triangles against all four screen edges, this could yield
-			// a bunch of triangles, so create a queue that we traverse to 
-			//  ensure we only test new triangles generated against planes
-			Triangle clipped[2];
-			list<Triangle> listTriangles;
-
-			// Add initial Triangle
-			listTriangles.push_back(triToRaster);
-			int nNewTriangles = 1;
-
-			for (int p = 0; p < 4; p++){
-				int nTrisToAdd = 0;
-				while (nNewTriangles > 0){
-					// Take Triangle from front of queue
-					Triangle test = listTriangles.front();
-					listTriangles.pop_front();
-					nNewTriangles--;
-
-					// Clip it against a plane. We only need to test each 
-					// subsequent plane, against subsequent new triangles
-					// as all triangles after a plane clip are guaranteed
-					// to lie on the inside of the plane. I like how this
-					// comment is almost completely and utterly justified
-					switch (p)
-					{
-					case 0:	nTrisToAdd = Triangle_ClipAgainstPlane({ 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, test, clipped[0], clipped[1]); break;
-					case 1:	nTrisToAdd = Triangle_ClipAgainstPlane({ 0.0f, (float)windowHeight - 1, 0.0f }, { 0.0f, -1.0f, 0.0f }, test, clipped[0], clipped[1]); break;
-					case 2:	nTrisToAdd = Triangle_ClipAgainstPlane({ 0.0f, 0.0f, 0.0f }, { 1.0f, 0.0f, 0.0f }, test, clipped[0], clipped[1]); break;
-					case 3:	nTrisToAdd = Triangle_ClipAgainstPlane({ (float)windowWidth - 1, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f }, test, clipped[0], clipped[1]); break;
-					}
-
-					// Clipping may yield a variable number of triangles, so
-					// add these new ones to the back of the queue for subsequent
-					// clipping against next planes
-					for (int w = 0; w < nTrisToAdd; w++)
-						listTriangles.push_back(clipped[w]);
-				}
-				nNewTriangles = listTriangles.size();
-			}
-
-
-			// Draw the transformed, viewed, clipped, projected, sorted, clipped triangles
-			for (auto &t : listTriangles){
-				// normalise to screen and push to draw list
-				for(int i = 0; i < 3; i++){
-					t.p[i].x = (t.p[i].x / (windowWidth / 2)) - 1;
-					t.p[i].y = (t.p[i].y / (windowHeight / 2)) - 1;					
-				}
+		if (bPaged){
+			pipeline.Begin(camera);
+			pagedMesh.Submit(pipeline, camera, fElapsedTime);
+			pipeline.End(drawList);
+			drawTriangle(drawList);
+			return true;
+		}
 
-				std::array<float, 9> point{t.p[0].x, t.p[0].y, 0.0f, t.p[1].x, t.p[1].y, 0.0f, t.p[2].x, t.p[2].y, 0.0f};
-				trianglesToDraw.push_back(point);
-				coloursToDraw.push_back(t.col);				
-			}
+		if (bTerrain){
+			pipeline.Begin(camera);
+			terrainTris.clear();
+			terrain.Generate(camera.pos, pipeline.frustum, terrainTris);
+			pipeline.Submit(terrainTris.data(), terrainTris.size());
+			pipeline.End(drawList);
+			drawTriangle(drawList);
+			return true;
 		}
 
+		if (options.bVisibilityCache){
+			visibility.Render(pipeline, camera, meshCube, drawList);
+		} else {
+			pipeline.Render(camera, meshCube, drawList);
+		}
 
-		drawTriangle(trianglesToDraw, coloursToDraw);
+		drawTriangle(drawList);
 
 		return true;
 	}
@@ -421,6 +335,14 @@ public:
 		int fps_update = 0;
 		double fps_elapsed_time = 0.0;
 
+		bool bMemoryKeyHeld = false;
+		bool bCaptureKeyHeld = false;
+		bool bPickHeld = false;
+
+		if (!options.captureDir.empty()){
+			StartCapture();
+		}
+
 		while (!glfwWindowShouldClose(window)){
 			// Run as fast as possible
 			
@@ -455,6 +377,7 @@ public:
 					camera.fPitch = -1.5f;
 				}
 
+				Vec3d oldPos = camera.pos;
 				Vec3d vForward = camera.lookDir * (8.0f * fElapsedTime);
 				Vec3d vRight = { camera.lookDir.z, 0, -camera.lookDir.x };
 				vRight = vRight * (8.0f * fElapsedTime);
@@ -491,10 +414,37 @@ public:
 					camera.pos.y -= 8.0f * fElapsedTime;
 				}
 
+				MoveCamera(oldPos);
+
+				//pick with the left mouse button
+				bool bPick = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+				if(bPick && !bPickHeld){
+					Pick();
+				}
+				bPickHeld = bPick;
+
 				//escape
 				if(glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS){
 					glfwSetWindowShouldClose(window, true);
 				}
+
+				//dump memory use, frame allocs are for the previous frame
+				bool bMemoryKey = glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS;
+				if(bMemoryKey && !bMemoryKeyHeld){
+					MemoryStats::Get().Report(std::cout);
+				}
+				bMemoryKeyHeld = bMemoryKey;
+
+				//start or stop recording frames
+				bool bCaptureKey = glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS;
+				if(bCaptureKey && !bCaptureKeyHeld){
+					if (capture.IsRunning()){
+						capture.Stop();
+					} else {
+						StartCapture();
+					}
+				}
+				bCaptureKeyHeld = bCaptureKey;
 					
 
 				// Handle Frame Update
@@ -507,8 +457,11 @@ public:
 				glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
 				glClear(GL_COLOR_BUFFER_BIT);
 
+				MemoryStats::Get().BeginFrame();
 				Render(fElapsedTime);
 
+				// Read back the finished frame before it is swapped away
+				capture.CaptureGL();
 
 				// Disable the vertex array functionality
 				glDisableClientState(GL_VERTEX_ARRAY);
@@ -523,6 +476,16 @@ public:
 					double average_fps = 50.0f / fps_elapsed_time;
 					// Update window title with FPS
 					std::string windowTitle = "GLFW game engine - FPS: " + std::to_string(average_fps);
+					if (bPointCloud){
+						windowTitle += " - points " + std::to_string((int)(splatter.Progress(cloud) * 100.0f)) + "%";
+					}
+					if (bPaged){
+						windowTitle += " - pages " + std::to_string(pagedMesh.ResidentPages()) + " resident, hit rate "
+							+ std::to_string((int)(pagedMesh.stats.HitRate() * 100.0)) + "%";
+					}
+					if (capture.IsRunning()){
+						windowTitle += " - recording, " + std::to_string(capture.nDropped) + " dropped";
+					}
 					glfwSetWindowTitle(window, windowTitle.c_str());
 					fps_update = 0;
 					fps_elapsed_time = 0.0;
@@ -533,7 +496,12 @@ public:
 				
 		}
 
-		// Clean up and exit
+		// Clean up and exit, capture needs the GL context to collect its last frames
+		capture.Stop();
+		MemoryStats::Get().Report(std::cout);
+		if (bPaged){
+			pagedMesh.stats.Report(std::cout);
+		}
     	glfwTerminate();
     	return;
 	}
@@ -543,10 +511,130 @@ public:
 
 
 
-int main(){
-	GameEngine3D game(1200, 800, "teapot.obj");
+void printUsage(){
+	std::cout << "Usage:" << std::endl;
+	std::cout << "  run.exe [model.obj|heightmap.pgm|model.pages] [--points] [--point-budget N] [--no-terrain] [--heightmap-scale SPACING HEIGHT] [--page-budget MB] [--capture DIR] [--capture-format png|ppm] [--collide-radius R] [--no-vis-cache]" << std::endl;
+	std::cout << "  run.exe --make-pages model.obj model.pages [--page-tris N]" << std::endl;
+	std::cout << "  run.exe --batch model.obj WIDTHxHEIGHT poses.txt outdir [--threads N] [--writers N] [--format png|ppm]" << std::endl;
+	std::cout << "  run.exe --bench [model.obj ...]" << std::endl;
+	std::cout << "  run.exe --bench-rays [model.obj ...]" << std::endl;
+	std::cout << "  run.exe --verify-vis [model.obj ...]" << std::endl;
+	std::cout << "Pose files have one \"x y z yaw pitch\" per line." << std::endl;
+	std::cout << "Any mode also takes --mem-cap MB to fail as soon as tracked memory goes over MB megabytes." << std::endl;
+}
+
+int runMode(vector<string> args){
+	// Options that apply to every mode
+	for (size_t i = 0; i < args.size(); ){
+		if (args[i] == "--mem-cap" && i + 1 < args.size()){
+			MemoryStats::Get().cap = (int64_t)(stod(args[i + 1]) * 1024 * 1024);
+			args.erase(args.begin() + i, args.begin() + i + 2);
+		} else {
+			i++;
+		}
+	}
+
+	if (!args.empty() && args[0] == "--make-pages"){
+		PageBuilder builder;
+		if (args.size() == 5 && args[3] == "--page-tris"){
+			builder.trisPerPage = stoul(args[4]);
+		} else if (args.size() != 3){
+			printUsage();
+			return -1;
+		}
+		return builder.Build(args[1], args[2]) ? 0 : -1;
+	}
+
+	if (!args.empty() && args[0] == "--bench"){
+		vector<string> models(args.begin() + 1, args.end());
+		if (models.empty())
+			models = { "teapot.obj", "VideoShip.obj", "mountains.obj" };
+		return Benchmark().Run(models);
+	}
+
+	if (!args.empty() && args[0] == "--bench-rays"){
+		vector<string> models(args.begin() + 1, args.end());
+		if (models.empty())
+			models = { "teapot.obj", "VideoShip.obj", "mountains.obj" };
+		return RayBenchmark().Run(models);
+	}
+
+	if (!args.empty() && args[0] == "--verify-vis"){
+		vector<string> models(args.begin() + 1, args.end());
+		if (models.empty())
+			models = { "teapot.obj", "VideoShip.obj", "mountains.obj" };
+		return VisibilityCheck().Run(models);
+	}
+
+	if (!args.empty() && args[0] == "--batch"){
+		int w = 0, h = 0;
+		char x = 0;
+		if (args.size() < 5 || !(stringstream(args[2]) >> w >> x >> h) || x != 'x' || w <= 0 || h <= 0){
+			printUsage();
+			return -1;
+		}
+
+		BatchRenderer batch(args[1], w, h, args[3], args[4]);
+		for (size_t i = 5; i + 1 < args.size(); i += 2){
+			if (args[i] == "--threads"){
+				batch.threads = stoi(args[i + 1]);
+			} else if (args[i] == "--writers"){
+				batch.writers = stoi(args[i + 1]);
+			} else if (args[i] == "--format" && (args[i + 1] == "png" || args[i + 1] == "ppm")){
+				batch.extension = "." + args[i + 1];
+			} else {
+				printUsage();
+				return -1;
+			}
+		}
+		return batch.Run();
+	}
+
+	string model = "teapot.obj";
+	ViewerOptions options;
+	for (size_t i = 0; i < args.size(); i++){
+		if (args[i] == "--point-budget" && i + 1 < args.size()){
+			options.pointBudget = stoul(args[++i]);
+		} else if (args[i] == "--points"){
+			options.bPoints = true;
+		} else if (args[i] == "--no-terrain"){
+			options.bDetectTerrain = false;
+		} else if (args[i] == "--page-budget" && i + 1 < args.size()){
+			options.pageBudgetMB = stoul(args[++i]);
+		} else if (args[i] == "--no-vis-cache"){
+			options.bVisibilityCache = false;
+		} else if (args[i] == "--collide-radius" && i + 1 < args.size()){
+			options.collisionRadius = stof(args[++i]);
+		} else if (args[i] == "--capture" && i + 1 < args.size()){
+			options.captureDir = args[++i];
+		} else if (args[i] == "--capture-format" && i + 1 < args.size() && (args[i + 1] == "png" || args[i + 1] == "ppm")){
+			options.captureExtension = "." + args[++i];
+		} else if (args[i] == "--heightmap-scale" && i + 2 < args.size()){
+			options.heightmapSpacing = stof(args[++i]);
+			options.heightmapHeight = stof(args[++i]);
+		} else if (i == 0 && args[i].rfind("--", 0) != 0){
+			model = args[i];
+		} else {
+			printUsage();
+			return -1;
+		}
+	}
+
+	GameEngine3D game(1200, 800, model, options);
 
 	game.Run();
 
     return 0;
 }
+
+
+
+int main(int argc, char* argv[]){
+	try {
+		return runMode(vector<string>(argv + 1, argv + argc));
+	} catch (const std::bad_alloc &) {
+		// Also raised by the tracking allocators when --mem-cap is exceeded
+		std::cerr << "Out of memory" << std::endl;
+		return -1;
+	}
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <vector>
+#include <list>
+
+// Subsystems that memory is accounted against
+enum class MemTag {
+	Mesh,			// Triangles kept for the life of a model
+	LoaderScratch,	// Temporary storage while reading a model file
+	FrameBuffers,	// CPU side images for batch rendering and capture
+	ClipScratch,	// Per frame triangles waiting to be sorted and clipped
+	DrawLists,		// Per frame screen space triangles handed to the rasteriser
+	PageCache,		// Resident pages of an out of core mesh
+	Bvh,			// Bounding volume hierarchy for ray and collision queries
+	Visibility,		// Lit triangles and per cluster results kept between frames
+	Count
+};
+
+inline const char* MemTagName(MemTag tag){
+	switch (tag){
+	case MemTag::Mesh: return "mesh";
+	case MemTag::LoaderScratch: return "loader scratch";
+	case MemTag::FrameBuffers: return "frame buffers";
+	case MemTag::ClipScratch: return "clip scratch";
+	case MemTag::DrawLists: return "draw lists";
+	case MemTag::PageCache: return "page cache";
+	case MemTag::Bvh: return "bvh";
+	case MemTag::Visibility: return "visibility";
+	default: return "?";
+	}
+}
+
+
+// Process wide byte and allocation counters for each MemTag
+class MemoryStats {
+public:
+	static const int nTags = (int)MemTag::Count;
+
+	std::atomic<int64_t> current[nTags];
+	std::atomic<int64_t> peak[nTags];
+	std::atomic<int64_t> allocs[nTags];
+	int64_t frameStartAllocs[nTags];
+	std::atomic<int64_t> total;
+	std::atomic<int64_t> peakTotal;	// Most bytes held across all tags at once
+	int64_t cap = 0;	// Bytes across all tags, 0 means no cap
+	std::atomic<bool> bFrames{ false };	// BeginFrame has been called
+
+	static MemoryStats& Get(){
+		static MemoryStats stats;
+		return stats;
+	}
+
+	void Allocated(MemTag tag, size_t bytes){
+		int i = (int)tag;
+		int64_t all = total += (int64_t)bytes;
+		if (cap > 0 && all > cap){
+			// Refused, so it counts towards nothing, not even the peak
+			total -= (int64_t)bytes;
+			std::cerr << "Memory cap of " << cap << " bytes exceeded allocating " << bytes << " bytes for " << MemTagName(tag) << std::endl;
+			Report(std::cerr);
+			throw std::bad_alloc();
+		}
+
+		int64_t now = current[i] += (int64_t)bytes;
+		allocs[i]++;
+
+		int64_t p = peak[i];
+		while (now > p && !peak[i].compare_exchange_weak(p, now)) {}
+		int64_t pAll = peakTotal;
+		while (all > pAll && !peakTotal.compare_exchange_weak(pAll, all)) {}
+	}
+
+	void Freed(MemTag tag, size_t bytes){
+		current[(int)tag] -= (int64_t)bytes;
+		total -= (int64_t)bytes;
+	}
+
+	// Mark the start of a frame so FrameAllocs counts only this frame's allocations
+	void BeginFrame(){
+		bFrames = true;
+		for (int i = 0; i < nTags; i++)
+			frameStartAllocs[i] = allocs[i];
+	}
+
+	int64_t FrameAllocs(MemTag tag) const {
+		return allocs[(int)tag] - frameStartAllocs[(int)tag];
+	}
+
+	// Start peaks again from the current values, used between benchmark models
+	void ResetPeaks(){
+		for (int i = 0; i < nTags; i++){
+			peak[i] = current[i].load();
+			allocs[i] = 0;
+			frameStartAllocs[i] = 0;
+		}
+		peakTotal = total.load();
+	}
+
+	// The frame allocs column is left out until BeginFrame has been called, batch and benchmark
+	// runs that have no frames would only show the allocations since the start
+	void Report(std::ostream &out) const {
+		bool bFrameAllocs = bFrames;
+		std::ios_base::fmtflags flags = out.flags();
+		std::streamsize precision = out.precision();
+
+		out << std::left << std::setw(16) << "subsystem" << std::right
+			<< std::setw(14) << "current KB" << std::setw(14) << "peak KB" << std::setw(12) << "allocs";
+		if (bFrameAllocs)
+			out << std::setw(14) << "frame allocs";
+		out << std::endl;
+
+		// Subsystems peak at different times, so the total peak is tracked on its own
+		int64_t sumCurrent = 0;
+		for (int i = 0; i < nTags; i++){
+			out << std::left << std::setw(16) << MemTagName((MemTag)i) << std::right << std::fixed << std::setprecision(1)
+				<< std::setw(14) << current[i] / 1024.0 << std::setw(14) << peak[i] / 1024.0
+				<< std::setw(12) << allocs[i];
+			if (bFrameAllocs)
+				out << std::setw(14) << FrameAllocs((MemTag)i);
+			out << std::endl;
+			sumCurrent += current[i];
+		}
+		out << std::left << std::setw(16) << "total" << std::right
+			<< std::setw(14) << sumCurrent / 1024.0 << std::setw(14) << peakTotal / 1024.0 << std::endl;
+		out.flags(flags);
+		out.precision(precision);
+	}
+
+private:
+	MemoryStats() : total(0), peakTotal(0) {
+		for (int i = 0; i < nTags; i++){
+			current[i] = 0;
+			peak[i] = 0;
+			allocs[i] = 0;
+			frameStartAllocs[i] = 0;
+		}
+	}
+};
+
+
+// Standard allocator that counts its bytes against a MemTag
+template <typename T, MemTag Tag>
+class TrackingAllocator {
+public:
+	typedef T value_type;
+
+	TrackingAllocator() = default;
+	template <typename U>
+	TrackingAllocator(const TrackingAllocator<U, Tag>&) {}
+
+	template <typename U>
+	struct rebind { typedef TrackingAllocator<U, Tag> other; };
+
+	// Counted only once the memory is really there, a cap refusal frees it again
+	T* allocate(size_t n){
+		T* p = static_cast<T*>(::operator new(n * sizeof(T)));
+		try {
+			MemoryStats::Get().Allocated(Tag, n * sizeof(T));
+		} catch (...) {
+			::operator delete(p);
+			throw;
+		}
+		return p;
+	}
+
+	void deallocate(T* p, size_t n){
+		MemoryStats::Get().Freed(Tag, n * sizeof(T));
+		::operator delete(p);
+	}
+
+	template <typename U>
+	bool operator==(const TrackingAllocator<U, Tag>&) const { return true; }
+	template <typename U>
+	bool operator!=(const TrackingAllocator<U, Tag>&) const { return false; }
+};
+
+template <typename T, MemTag Tag>
+using TrackedVector = std::vector<T, TrackingAllocator<T, Tag>>;
+
+template <typename T, MemTag Tag>
+using TrackedList = std::list<T, TrackingAllocator<T, Tag>>;
@@ -0,0 +1,678 @@
+#pragma once
+
+#include "pipeline.h"
+#include "queue.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// Page file layout: a PageFileHeader, nPages PageEntry records, then the triangles of every
+// page as 9 floats each. Pages are stored in Morton order of their grid cell so pages that are
+// close in space are also close on disk
+class PageFileHeader {
+public:
+	char magic[4] = { 'B', 'V', 'P', 'G' };
+	uint32_t version = 1;
+	uint32_t nPages = 0;
+	uint32_t pad = 0;
+	uint64_t nTris = 0;
+	float boundsMin[3] = { 0, 0, 0 };
+	float boundsMax[3] = { 0, 0, 0 };
+};
+
+class PageEntry {
+public:
+	float boundsMin[3];
+	float boundsMax[3];
+	uint64_t offset;	// Bytes from the start of the file
+	uint32_t nTris;
+	uint32_t pad;
+};
+
+
+// A read only memory mapped file
+class MappedFile {
+public:
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile(){ Close(); }
+
+	bool Open(const std::string &sFilename){
+		Close();
+#ifdef _WIN32
+		hFile = CreateFileA(sFilename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart == 0){
+			Close();
+			return false;
+		}
+		size = (size_t)fileSize.QuadPart;
+		hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMapping == NULL){
+			Close();
+			return false;
+		}
+		data = (const uint8_t*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		fd = open(sFilename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0){
+			Close();
+			return false;
+		}
+		size = (size_t)st.st_size;
+		void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		data = p == MAP_FAILED ? nullptr : (const uint8_t*)p;
+#endif
+		if (data == nullptr){
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close(){
+#ifdef _WIN32
+		if (data) UnmapViewOfFile(data);
+		if (hMapping != NULL) CloseHandle(hMapping);
+		if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+		hMapping = NULL;
+		hFile = INVALID_HANDLE_VALUE;
+#else
+		if (data) munmap((void*)data, size);
+		if (fd >= 0) close(fd);
+		fd = -1;
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	HANDLE hMapping = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+
+// Splits an obj file into spatial pages on disk, for models too big to load as a Mesh.
+// The file is streamed three times: once for vertices and bounds, once to count the triangles
+// in each grid cell and once to write them out. Only the vertex positions are held in memory
+class PageBuilder {
+public:
+	uint32_t trisPerPage = 16384;	// Target page size, pages are grid cells so this is approximate
+	size_t writeBufferBytes = 64 << 20;
+
+	bool Build(const std::string &sObjFile, const std::string &sPageFile){
+		auto tStart = std::chrono::steady_clock::now();
+
+		// Pass 1, vertices and triangle count
+		TrackedVector<float, MemTag::LoaderScratch> verts;
+		uint64_t nTris = 0;
+		float bmin[3] = { 1e30f, 1e30f, 1e30f }, bmax[3] = { -1e30f, -1e30f, -1e30f };
+		if (!ReadObj(sObjFile, [&](float x, float y, float z){
+				float v[3] = { x, y, z };
+				for (int a = 0; a < 3; a++){
+					verts.push_back(v[a]);
+					bmin[a] = std::min(bmin[a], v[a]);
+					bmax[a] = std::max(bmax[a], v[a]);
+				}
+			}, [&](const long*, int n){ nTris += n - 2; }))
+			return false;
+
+		size_t nVerts = verts.size() / 3;
+		if (nTris == 0){
+			std::cerr << "No faces in " << sObjFile << std::endl;
+			return false;
+		}
+
+		// Grid with about two cells per page worth of triangles, shaped like the bounds
+		float extent[3];
+		for (int a = 0; a < 3; a++)
+			extent[a] = std::max(bmax[a] - bmin[a], 1e-6f);
+		double nCellsWanted = std::max(1.0, 2.0 * nTris / trisPerPage);
+		float maxExtent = std::max({ extent[0], extent[1], extent[2] });
+		for (int a = 0; a < 3; a++)
+			extent[a] = std::max(extent[a], maxExtent * 0.01f);
+		double s = cbrt(nCellsWanted / ((double)extent[0] * extent[1] * extent[2]));
+		for (int a = 0; a < 3; a++)
+			dims[a] = std::min(1023, std::max(1, (int)std::round(extent[a] * s)));
+		for (int a = 0; a < 3; a++){
+			gridMin[a] = bmin[a];
+			cellSize[a] = extent[a] / dims[a];
+		}
+		size_t nCells = (size_t)dims[0] * dims[1] * dims[2];
+
+		auto vertex = [&](long i){ return &verts[(size_t)i * 3]; };
+		auto cellOf = [&](const float *a, const float *b, const float *c){
+			int cell[3];
+			for (int k = 0; k < 3; k++){
+				float centre = (a[k] + b[k] + c[k]) / 3.0f;
+				cell[k] = std::min(dims[k] - 1, std::max(0, (int)((centre - gridMin[k]) / cellSize[k])));
+			}
+			return ((size_t)cell[2] * dims[1] + cell[1]) * dims[0] + cell[0];
+		};
+
+		// Pass 2, count triangles per cell
+		std::vector<uint32_t> counts(nCells, 0);
+		bool bBadIndex = false;
+		if (!ReadObj(sObjFile, nullptr, [&](const long *idx, int n){
+				for (int k = 0; k + 2 < n; k++){
+					if (!Valid(idx[0], nVerts) || !Valid(idx[k + 1], nVerts) || !Valid(idx[k + 2], nVerts)){
+						bBadIndex = true;
+						continue;
+					}
+					counts[cellOf(vertex(idx[0]), vertex(idx[k + 1]), vertex(idx[k + 2]))]++;
+				}
+			}))
+			return false;
+		if (bBadIndex)
+			std::cerr << "Skipping faces with out of range vertex indices" << std::endl;
+
+		// Order the non empty cells along a Morton curve and lay them out one after another
+		std::vector<std::pair<uint64_t, uint32_t>> order;
+		for (size_t c = 0; c < nCells; c++){
+			if (counts[c] == 0)
+				continue;
+			uint32_t cx = c % dims[0], cy = (c / dims[0]) % dims[1], cz = (uint32_t)(c / ((size_t)dims[0] * dims[1]));
+			order.push_back({ Morton(cx, cy, cz), (uint32_t)c });
+		}
+		std::sort(order.begin(), order.end());
+
+		PageFileHeader header;
+		header.nPages = (uint32_t)order.size();
+		header.nTris = 0;
+		for (int a = 0; a < 3; a++){
+			header.boundsMin[a] = bmin[a];
+			header.boundsMax[a] = bmax[a];
+		}
+
+		std::vector<PageEntry> pages(order.size());
+		std::vector<int32_t> pageOfCell(nCells, -1);
+		uint64_t offset = sizeof(PageFileHeader) + sizeof(PageEntry) * pages.size();
+		for (size_t p = 0; p < order.size(); p++){
+			PageEntry &page = pages[p];
+			page.nTris = 0;
+			page.pad = 0;
+			page.offset = offset;
+			for (int a = 0; a < 3; a++){
+				page.boundsMin[a] = 1e30f;
+				page.boundsMax[a] = -1e30f;
+			}
+			offset += (uint64_t)counts[order[p].second] * 36;
+			pageOfCell[order[p].second] = (int32_t)p;
+		}
+
+		std::ofstream out(sPageFile, std::ios::binary | std::ios::trunc);
+		if (!out.is_open()){
+			std::cerr << "Failed to create " << sPageFile << std::endl;
+			return false;
+		}
+
+		// Pass 3, write triangles through a small buffer per page
+		size_t bufferTris = std::max<size_t>(1, writeBufferBytes / 36 / std::max<size_t>(1, pages.size()));
+		bufferTris = std::min<size_t>(bufferTris, 4096);
+		std::vector<std::vector<float>> buffers(pages.size());
+
+		auto flush = [&](size_t p){
+			std::vector<float> &buf = buffers[p];
+			if (buf.empty())
+				return;
+			out.seekp((std::streamoff)(pages[p].offset + (uint64_t)pages[p].nTris * 36 - buf.size() * sizeof(float)));
+			out.write((const char*)buf.data(), buf.size() * sizeof(float));
+			buf.clear();
+		};
+
+		if (!ReadObj(sObjFile, nullptr, [&](const long *idx, int n){
+				for (int k = 0; k + 2 < n; k++){
+					if (!Valid(idx[0], nVerts) || !Valid(idx[k + 1], nVerts) || !Valid(idx[k + 2], nVerts))
+						continue;
+					const float *v[3] = { vertex(idx[0]), vertex(idx[k + 1]), vertex(idx[k + 2]) };
+					size_t p = pageOfCell[cellOf(v[0], v[1], v[2])];
+					PageEntry &page = pages[p];
+					for (int i = 0; i < 3; i++){
+						for (int a = 0; a < 3; a++){
+							buffers[p].push_back(v[i][a]);
+							page.boundsMin[a] = std::min(page.boundsMin[a], v[i][a]);
+							page.boundsMax[a] = std::max(page.boundsMax[a], v[i][a]);
+						}
+					}
+					page.nTris++;
+					header.nTris++;
+					if (buffers[p].size() >= bufferTris * 9)
+						flush(p);
+				}
+			}))
+			return false;
+
+		for (size_t p = 0; p < pages.size(); p++)
+			flush(p);
+
+		out.seekp(0);
+		out.write((const char*)&header, sizeof(header));
+		out.write((const char*)pages.data(), sizeof(PageEntry) * pages.size());
+		if (!out.good()){
+			std::cerr << "Failed writing " << sPageFile << std::endl;
+			return false;
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - tStart;
+		std::cout << "Wrote " << header.nTris << " triangles in " << pages.size() << " pages (" << dims[0] << "x" << dims[1] << "x" << dims[2]
+			<< " grid) to " << sPageFile << " in " << elapsed.count() << " s" << std::endl;
+		return true;
+	}
+
+private:
+	int dims[3] = { 1, 1, 1 };
+	float gridMin[3];
+	float cellSize[3];
+
+	static bool Valid(long i, size_t nVerts){
+		return i >= 0 && (size_t)i < nVerts;
+	}
+
+	static uint64_t Morton(uint32_t x, uint32_t y, uint32_t z){
+		uint64_t code = 0;
+		for (int b = 0; b < 10; b++){
+			code |= (uint64_t)((x >> b) & 1) << (3 * b);
+			code |= (uint64_t)((y >> b) & 1) << (3 * b + 1);
+			code |= (uint64_t)((z >> b) & 1) << (3 * b + 2);
+		}
+		return code;
+	}
+
+	// Streams "v" and "f" lines. Face indices are converted to 0 based, "f 1/2/3" style
+	// indices use the position only and negative indices count back from the last vertex
+	// read so far, which is the same in every pass
+	template <typename OnVertex, typename OnFace>
+	static bool ReadObj(const std::string &sFilename, OnVertex onVertex, OnFace onFace){
+		std::ifstream f(sFilename);
+		if (!f.is_open()){
+			std::cerr << "Failed to open " << sFilename << std::endl;
+			return false;
+		}
+
+		std::string line;
+		long idx[64];
+		long nVertsSoFar = 0;
+		while (std::getline(f, line)){
+			if (line.size() < 2 || line[1] != ' ')
+				continue;
+
+			if (line[0] == 'v'){
+				nVertsSoFar++;
+				CallVertex(onVertex, line.c_str() + 2);
+			} else if (line[0] == 'f'){
+				const char *s = line.c_str() + 2;
+				int n = 0;
+				char *end;
+				while (n < 64){
+					long i = strtol(s, &end, 10);
+					if (end == s)
+						break;
+					idx[n++] = i < 0 ? nVertsSoFar + i : i - 1;
+					s = end;
+					while (*s && *s != ' ' && *s != '\t')
+						s++;
+				}
+				if (n >= 3)
+					onFace(idx, n);
+			}
+		}
+		return true;
+	}
+
+	template <typename OnVertex>
+	static void CallVertex(OnVertex &onVertex, const char *s){
+		char *end;
+		float x = strtof(s, &end); s = end;
+		float y = strtof(s, &end); s = end;
+		float z = strtof(s, &end);
+		onVertex(x, y, z);
+	}
+
+	static void CallVertex(std::nullptr_t, const char *){}
+};
+
+
+// Page residency counters, updated by the render and prefetch threads
+class PageStats {
+public:
+	std::atomic<uint64_t> faults{ 0 };		// Visible pages that had to be read on the render thread
+	std::atomic<uint64_t> hits{ 0 };		// Visible pages that were already resident
+	std::atomic<uint64_t> prefetched{ 0 };	// Pages read ahead by the prefetch thread
+	std::atomic<uint64_t> prefetchHits{ 0 };	// Hits on pages that were brought in by prefetching
+	std::atomic<uint64_t> evictions{ 0 };
+	std::atomic<uint64_t> bytesRead{ 0 };
+	std::atomic<uint64_t> readNanoseconds{ 0 };
+
+	double HitRate() const {
+		uint64_t total = hits + faults;
+		return total == 0 ? 1.0 : (double)hits / total;
+	}
+
+	// Bytes copied out of the mapping per second spent reading, on either thread
+	double BandwidthMBs() const {
+		return readNanoseconds == 0 ? 0.0 : (double)bytesRead / (1024.0 * 1024.0) / (readNanoseconds * 1e-9);
+	}
+
+	void Report(std::ostream &out) const {
+		out << "pages: " << hits << " hits, " << faults << " faults, hit rate " << HitRate() * 100.0 << "%, "
+			<< prefetched << " prefetched (" << prefetchHits << " used), " << evictions << " evicted, "
+			<< bytesRead / (1024.0 * 1024.0) << " MB read at " << BandwidthMBs() << " MB/s" << std::endl;
+	}
+};
+
+
+// A page file opened for drawing. Pages whose bounds touch the view frustum are copied out of the
+// mapping into an LRU cache that is kept under budgetBytes. A background thread reads ahead the
+// pages that will be visible if the camera keeps moving and turning the way it is
+class PagedMesh {
+public:
+	size_t budgetBytes = (size_t)256 << 20;
+	float fPrefetchSeconds = 0.5f;	// How far along the camera's motion to look ahead
+	PageStats stats;
+
+	PageFileHeader header;
+
+	~PagedMesh(){ Close(); }
+
+	bool Open(const std::string &sFilename){
+		Close();
+		if (!file.Open(sFilename))
+			return false;
+
+		if (file.size < sizeof(PageFileHeader))
+			return Fail(sFilename);
+		memcpy(&header, file.data, sizeof(header));
+		if (memcmp(header.magic, "BVPG", 4) != 0 || header.version != 1
+			|| file.size < sizeof(PageFileHeader) + (uint64_t)header.nPages * sizeof(PageEntry))
+			return Fail(sFilename);
+
+		directory = (const PageEntry*)(file.data + sizeof(PageFileHeader));
+		for (uint32_t p = 0; p < header.nPages; p++){
+			if (directory[p].offset + (uint64_t)directory[p].nTris * 36 > file.size)
+				return Fail(sFilename);
+		}
+
+		bStop = false;
+		requests.reset(new BoundedQueue<uint32_t>(256));
+		prefetchThread = std::thread([this]{ PrefetchLoop(); });
+		return true;
+	}
+
+	void Close(){
+		if (prefetchThread.joinable()){
+			bStop = true;
+			requests->Close();
+			prefetchThread.join();
+		}
+		cache.clear();
+		pending.clear();
+		residentBytes = 0;
+		directory = nullptr;
+		file.Close();
+	}
+
+	// Submit the triangles of every visible page. Call between pipeline.Begin and pipeline.End
+	void Submit(Pipeline &pipeline, Camera &camera, float fElapsedTime){
+		frame++;
+		UpdateMotion(camera, fElapsedTime);
+
+		for (uint32_t p = 0; p < header.nPages; p++){
+			if (!Visible(pipeline.frustum, p))
+				continue;
+
+			std::shared_ptr<Page> page;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				auto it = cache.find(p);
+				if (it != cache.end()){
+					page = it->second;
+					page->lastUsed = frame;
+					stats.hits++;
+					if (page->bPrefetched){
+						stats.prefetchHits++;
+						page->bPrefetched = false;
+					}
+				}
+			}
+
+			if (!page){
+				std::shared_ptr<Page> loaded = Load(p);
+				loaded->lastUsed = frame;
+				std::lock_guard<std::mutex> lock(mtx);
+				auto inserted = cache.insert({ p, loaded });
+				page = inserted.first->second;
+				if (inserted.second){
+					stats.faults++;
+					residentBytes += page->Bytes();
+				} else {
+					// The prefetcher got there first, so this read was not needed
+					page->lastUsed = frame;
+					stats.hits++;
+					stats.prefetchHits++;
+					page->bPrefetched = false;
+				}
+			}
+
+			pipeline.Submit(page->tris.data(), page->tris.size());
+		}
+
+		Evict();
+		Prefetch(pipeline, camera);
+	}
+
+	size_t ResidentBytes(){
+		std::lock_guard<std::mutex> lock(mtx);
+		return residentBytes;
+	}
+
+	size_t ResidentPages(){
+		std::lock_guard<std::mutex> lock(mtx);
+		return cache.size();
+	}
+
+private:
+	class Page {
+	public:
+		TrackedVector<Triangle, MemTag::PageCache> tris;
+		uint64_t lastUsed = 0;
+		bool bPrefetched = false;
+
+		size_t Bytes() const { return tris.capacity() * sizeof(Triangle); }
+	};
+
+	MappedFile file;
+	const PageEntry *directory = nullptr;
+
+	std::mutex mtx;	// Guards cache, pending and residentBytes
+	std::unordered_map<uint32_t, std::shared_ptr<Page>> cache;
+	std::unordered_set<uint32_t> pending;	// Queued for prefetch
+	size_t residentBytes = 0;
+	std::atomic<uint64_t> frame{ 0 };
+
+	std::unique_ptr<BoundedQueue<uint32_t>> requests;
+	std::thread prefetchThread;
+	std::atomic<bool> bStop{ false };
+
+	// Camera motion, smoothed over a few frames
+	bool bHaveLast = false;
+	Vec3d lastPos;
+	float lastYaw = 0, lastPitch = 0;
+	Vec3d velocity;
+	float yawRate = 0, pitchRate = 0;
+
+	bool Fail(const std::string &sFilename){
+		std::cerr << "Not a valid page file " << sFilename << std::endl;
+		file.Close();
+		return false;
+	}
+
+	bool Visible(const Frustum &frustum, uint32_t p) const {
+		const PageEntry &e = directory[p];
+		return frustum.intersectsBox(Vec3d(e.boundsMin[0], e.boundsMin[1], e.boundsMin[2]), Vec3d(e.boundsMax[0], e.boundsMax[1], e.boundsMax[2]));
+	}
+
+	size_t PageBytes(uint32_t p) const {
+		return directory[p].nTris * sizeof(Triangle);
+	}
+
+	// Copy a page out of the mapping. This is where the operating system reads the file
+	std::shared_ptr<Page> Load(uint32_t p){
+		auto tStart = std::chrono::steady_clock::now();
+
+		const PageEntry &e = directory[p];
+		std::shared_ptr<Page> page = std::make_shared<Page>();
+		page->tris.resize(e.nTris);
+		const float *src = (const float*)(file.data + e.offset);
+		for (uint32_t t = 0; t < e.nTris; t++, src += 9){
+			Triangle &tri = page->tris[t];
+			tri.p[0] = Vec3d(src[0], src[1], src[2]);
+			tri.p[1] = Vec3d(src[3], src[4], src[5]);
+			tri.p[2] = Vec3d(src[6], src[7], src[8]);
+			tri.col = 0.0f;
+		}
+
+		std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - tStart;
+		stats.bytesRead += (uint64_t)e.nTris * 36;
+		stats.readNanoseconds += (uint64_t)elapsed.count();
+		return page;
+	}
+
+	// Drop least recently used pages not needed this frame until under budget
+	void Evict(){
+		std::lock_guard<std::mutex> lock(mtx);
+		if (residentBytes <= budgetBytes)
+			return;
+
+		std::vector<std::pair<uint64_t, uint32_t>> candidates;
+		for (auto &entry : cache){
+			if (entry.second->lastUsed < frame)
+				candidates.push_back({ entry.second->lastUsed, entry.first });
+		}
+		std::sort(candidates.begin(), candidates.end());
+
+		for (auto &c : candidates){
+			if (residentBytes <= budgetBytes)
+				break;
+			auto it = cache.find(c.second);
+			residentBytes -= it->second->Bytes();
+			cache.erase(it);
+			stats.evictions++;
+		}
+	}
+
+	void UpdateMotion(Camera &camera, float fElapsedTime){
+		if (bHaveLast && fElapsedTime > 0.0f){
+			// Exponential smoothing so a single jerky frame does not swing the prediction
+			float k = std::min(1.0f, fElapsedTime * 8.0f);
+			Vec3d v = (camera.pos - lastPos) / fElapsedTime;
+			velocity = velocity + (v - velocity) * k;
+			yawRate += ((camera.fYaw - lastYaw) / fElapsedTime - yawRate) * k;
+			pitchRate += ((camera.fPitch - lastPitch) / fElapsedTime - pitchRate) * k;
+		}
+		lastPos = camera.pos;
+		lastYaw = camera.fYaw;
+		lastPitch = camera.fPitch;
+		bHaveLast = true;
+	}
+
+	// Queue the pages visible from where the camera is heading
+	void Prefetch(Pipeline &pipeline, Camera &camera){
+		float speed = velocity.vec_length(velocity);
+		if (speed < 1e-3f && fabsf(yawRate) < 1e-3f && fabsf(pitchRate) < 1e-3f)
+			return;
+
+		Camera predicted = camera;
+		predicted.pos = camera.pos + velocity * fPrefetchSeconds;
+		predicted.fYaw = camera.fYaw + yawRate * fPrefetchSeconds;
+		predicted.fPitch = std::max(-1.5f, std::min(1.5f, camera.fPitch + pitchRate * fPrefetchSeconds));
+		predicted.matView();	// updates lookDir
+		Frustum frustum = Frustum::fromCamera(predicted, Pipeline::fFov, (float)pipeline.height / (float)pipeline.width, Pipeline::fNear, Pipeline::fFar);
+
+		for (uint32_t p = 0; p < header.nPages; p++){
+			if (!Visible(frustum, p))
+				continue;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				if (cache.count(p) || pending.count(p))
+					continue;
+				pending.insert(p);
+			}
+			if (!requests->TryPush(p)){
+				// Queue full, try again next frame
+				std::lock_guard<std::mutex> lock(mtx);
+				pending.erase(p);
+				break;
+			}
+		}
+	}
+
+	void PrefetchLoop(){
+		uint32_t p;
+		while (!bStop && requests->Pop(p)){
+			{
+				// Never push out pages in use to make room for a guess
+				std::lock_guard<std::mutex> lock(mtx);
+				if (cache.count(p) || residentBytes + PageBytes(p) > budgetBytes){
+					pending.erase(p);
+					continue;
+				}
+			}
+
+			std::shared_ptr<Page> page;
+			try {
+				page = Load(p);
+			} catch (const std::bad_alloc &) {
+				// Over --mem-cap, stop reading ahead and leave pages to the render thread
+				std::cerr << "Out of memory prefetching page " << p << ", prefetching stopped" << std::endl;
+				std::lock_guard<std::mutex> lock(mtx);
+				pending.clear();
+				requests->Close();
+				return;
+			}
+			page->bPrefetched = true;
+			page->lastUsed = frame;
+
+			std::lock_guard<std::mutex> lock(mtx);
+			pending.erase(p);
+			if (cache.insert({ p, page }).second){
+				residentBytes += page->Bytes();
+				stats.prefetched++;
+			}
+		}
+	}
+};
@@ -0,0 +1,369 @@
+#pragma once
+
+#include "header.h"
+
+// Screen space triangles ready to be drawn, x/y in normalised device coordinates
+class DrawList {
+public:
+	TrackedVector<std::array<float, 9>, MemTag::DrawLists> triangles;
+	TrackedVector<float, MemTag::DrawLists> colours;
+
+	void clear(){
+		triangles.clear();
+		colours.clear();
+	}
+};
+
+
+// The software geometry pipeline: transform, cull, light, clip, project and sort.
+// It does not touch OpenGL, so it can run on any thread and with no window.
+// Usage per frame is Begin(camera), Submit(triangles) as many times as needed, End(drawList)
+class Pipeline {
+public:
+	Mat4 matProj;	// Matrix that converts from view space to screen space
+	Frustum frustum;	// World space view volume of the current frame, set by Begin
+	int width = 0;
+	int height = 0;
+
+	static constexpr float fFov = 90.0f;
+	static constexpr float fNear = 0.1f;
+	static constexpr float fFar = 1000.0f;
+
+	Pipeline() = default;
+	Pipeline(int w, int h) : width(w), height(h) {
+		matProj = Mat4::makeProjection(fFov, (float)height / (float)width, fNear, fFar);
+	}
+
+	Vec3d Vector_IntersectPlane(Vec3d &plane_p, Vec3d &plane_n, Vec3d &lineStart, Vec3d &lineEnd){
+		plane_n = plane_n.normalise();
+		float plane_d = -plane_n.dot_product(plane_p);
+		float ad = lineStart.dot_product(plane_n);
+		float bd = lineEnd.dot_product(plane_n);
+		float t = (-plane_d - ad) / (bd - ad);
+		Vec3d lineStartToEnd = lineEnd - lineStart;
+		Vec3d lineToIntersect = lineStartToEnd * t;
+		return lineStart + lineToIntersect;
+	}
+
+	int Triangle_ClipAgainstPlane(Vec3d plane_p, Vec3d plane_n, Triangle &in_tri, Triangle &out_tri1, Triangle &out_tri2){
+		// Make sure plane normal is indeed normal
+		plane_n = plane_n.normalise();
+
+		// Return signed shortest distance from point to plane, plane normal must be normalised
+		auto dist = [&](Vec3d &p)
+		{
+			//Vec3d n = Vector_Normalise(p);
+			return (plane_n.x * p.x + plane_n.y * p.y + plane_n.z * p.z - plane_n.dot_product(plane_p));
+		};
+
+		// Create two temporary storage arrays to classify points either side of plane
+		// If distance sign is positive, point lies on "inside" of plane
+		Vec3d* inside_points[3];  int nInsidePointCount = 0;
+		Vec3d* outside_points[3]; int nOutsidePointCount = 0;
+
+		// Get signed distance of each point in Triangle to plane
+		float d0 = dist(in_tri.p[0]);
+		float d1 = dist(in_tri.p[1]);
+		float d2 = dist(in_tri.p[2]);
+
+		if (d0 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[0]; }
+		else { outside_points[nOutsidePointCount++] = &in_tri.p[0]; }
+		if (d1 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[1]; }
+		else { outside_points[nOutsidePointCount++] = &in_tri.p[1]; }
+		if (d2 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[2]; }
+		else { outside_points[nOutsidePointCount++] = &in_tri.p[2]; }
+
+		// Now classify Triangle points, and break the input Triangle into
+		// smaller output triangles if required. There are four possible
+		// outcomes...
+
+		if (nInsidePointCount == 0)
+		{
+			// All points lie on the outside of plane, so clip whole Triangle
+			// It ceases to exist
+
+			return 0; // No returned triangles are valid
+		}
+
+		if (nInsidePointCount == 3)
+		{
+			// All points lie on the inside of plane, so do nothing
+			// and allow the Triangle to simply pass through
+			out_tri1 = in_tri;
+
+			return 1; // Just the one returned original Triangle is valid
+		}
+
+		if (nInsidePointCount == 1 && nOutsidePointCount == 2)
+		{
+			// Triangle should be clipped. As two points lie outside
+			// the plane, the Triangle simply becomes a smaller Triangle
+
+			// Copy appearance info to new Triangle
+			out_tri1.col =  in_tri.col;
+
+			// The inside point is valid, so keep that...
+			out_tri1.p[0] = *inside_points[0];
+
+			// but the two new points are at the locations where the
+			// original sides of the Triangle (lines) intersect with the plane
+			out_tri1.p[1] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[0], *outside_points[0]);
+			out_tri1.p[2] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[0], *outside_points[1]);
+
+			return 1; // Return the newly formed single Triangle
+		}
+
+		if (nInsidePointCount == 2 && nOutsidePointCount == 1)
+		{
+			// Triangle should be clipped. As two points lie inside the plane,
+			// the clipped Triangle becomes a "quad". Fortunately, we can
+			// represent a quad with two new triangles
+
+			// Copy appearance info to new triangles
+			out_tri1.col =  in_tri.col;
+
+			out_tri2.col =  in_tri.col;
+
+			// The first Triangle consists of the two inside points and a new
+			// point determined by the location where one side of the Triangle
+			// intersects with the plane
+			out_tri1.p[0] = *inside_points[0];
+			out_tri1.p[1] = *inside_points[1];
+			out_tri1.p[2] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[0], *outside_points[0]);
+
+			// The second Triangle is composed of one of he inside points, a
+			// new point determined by the intersection of the other side of the
+			// Triangle and the plane, and the newly created point above
+			out_tri2.p[0] = *inside_points[1];
+			out_tri2.p[1] = out_tri1.p[2];
+			out_tri2.p[2] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[1], *outside_points[0]);
+
+			return 2; // Return two newly formed triangles which form a quad
+		}
+		return 0;
+	}
+
+	// Start a new frame as seen from camera
+	void Begin(Camera &camera){
+		matWorld = Mat4::makeIdentity();	// Form World Matrix
+
+		// Get view matrix from camera class
+		matView = camera.matView();
+		cameraPos = camera.pos;
+		frustum = Frustum::fromCamera(camera, fFov, (float)height / (float)width, fNear, fFar);
+
+		vecTrianglesToClip.clear();
+	}
+
+	Vec3d CameraPos() const { return cameraPos; }
+
+	// Transform, cull, light, near clip and project a batch of world space triangles
+	void Submit(const Triangle *tris, size_t nTris){
+		for (size_t t = 0; t < nTris; t++){
+			Triangle triTransformed = ToWorld(tris[t]);
+			Vec3d normal = FaceNormal(triTransformed);
+
+			// If ray is aligned with normal, then Triangle is visible
+			if (FacesCamera(triTransformed, normal)){
+				triTransformed.col = Shade(normal);
+				SubmitLit(triTransformed);
+			}
+		}
+	}
+
+	// World Matrix Transform. Begin always sets the identity, so results can be kept between frames
+	Triangle ToWorld(const Triangle &tri) const {
+		Triangle triTransformed;
+		Mat4 matrix = matWorld;
+		for(int i = 0; i < 3; i++){
+			triTransformed.p[i] = matrix * tri.p[i];
+		}
+		return triTransformed;
+	}
+
+	// Unit normal of a world space triangle
+	static Vec3d FaceNormal(Triangle &triTransformed){
+		Vec3d normal, line1, line2;
+
+		// Get lines either side of Triangle
+		line1 = triTransformed.p[1] - triTransformed.p[0];
+		line2 = triTransformed.p[2] - triTransformed.p[0];
+
+		// Take cross product of lines to get normal to Triangle surface
+		normal = line1.cross_product(line2);
+
+		// You normally need to normalise a normal!
+		return normal.normalise();
+	}
+
+	// Signed distance of the camera behind the triangle's plane, negative when the front faces the camera
+	float FacingDistance(Triangle &triTransformed, Vec3d normal) const {
+		// Get Ray from Triangle to camera
+		Vec3d vCameraRay = triTransformed.p[0] - cameraPos;
+		return normal.dot_product(vCameraRay);
+	}
+
+	bool FacesCamera(Triangle &triTransformed, Vec3d normal) const {
+		return FacingDistance(triTransformed, normal) < 0.0f;
+	}
+
+	// Illumination, depends only on the normal
+	static float Shade(Vec3d normal){
+		Vec3d light_direction = { 0.0f, 1.0f, -0.5f };
+		light_direction = light_direction.normalise();
+
+		// How "aligned" are light direction and Triangle surface normal?
+		float dp = std::max(0.2f, (float)(light_direction.dot_product(normal) * 1));
+		dp = std::min(dp, 0.85f);
+		return dp;
+	}
+
+	// Second half of Submit for a world space triangle that faces the camera and has its colour set
+	void SubmitLit(Triangle &triTransformed){
+		Triangle triViewed;
+
+		// Convert World Space --> View Space
+		for(int i = 0; i < 3; i++){
+			triViewed.p[i] = matView * triTransformed.p[i];
+		}
+		triViewed.col = triTransformed.col;
+
+		ClipAndProject(triViewed);
+	}
+
+	// Clip a view space Triangle against the near plane and project the pieces to screen
+	void ClipAndProject(Triangle &triViewed){
+		// Clip Viewed Triangle against near plane, this could form two additional
+		// additional triangles.
+		int nClippedTriangles = 0;
+		Triangle clipped[2];
+		nClippedTriangles = Triangle_ClipAgainstPlane({ 0.0f, 0.0f, 0.1f }, { 0.0f, 0.0f, 1.0f }, triViewed, clipped[0], clipped[1]);
+
+		// We may end up with multiple triangles form the clip, so project as
+		// required
+		for (int n = 0; n < nClippedTriangles; n++){
+			Triangle triProjected;
+			Vec3d vOffsetView = { 1,1,0 };
+
+			//for each point in the triangle
+			for (int i = 0; i < 3; i++){
+				// Project triangles from 3D --> 2D
+				triProjected.p[i] = matProj * clipped[n].p[i];
+
+				// Scale into view, we moved the normalising into cartesian space
+				// out of the matrix.vector function from the previous videos, so
+				// do this manually
+				triProjected.p[i] = triProjected.p[i] / triProjected.p[i].w;
+
+				// X/Y are inverted so put them back
+				triProjected.p[i].x *= -1.0f;
+				triProjected.p[i].y *= 1.0f;
+
+				// Offset verts into visible normalised space
+				triProjected.p[i] = triProjected.p[i] + vOffsetView;
+
+				// Scale into view
+				triProjected.p[i].x *= 0.5f * (float)width;
+				triProjected.p[i].y *= 0.5f * (float)height;
+			}
+			triProjected.col = clipped[n].col;
+
+			// Store Triangle for sorting
+			vecTrianglesToClip.push_back(triProjected);
+		}
+	}
+
+	// Sort everything submitted this frame, clip it to the screen edges and fill the draw list
+	void End(DrawList &out){
+		out.clear();
+
+		// Sort triangles from back to front. Ties are broken on the screen positions so the order
+		// does not depend on what else was submitted, such as triangles that end up off screen
+		std::sort(vecTrianglesToClip.begin(), vecTrianglesToClip.end(), [](const Triangle &t1, const Triangle &t2){
+			float z1 = (t1.p[0].z + t1.p[1].z + t1.p[2].z) / 3.0f;
+			float z2 = (t2.p[0].z + t2.p[1].z + t2.p[2].z) / 3.0f;
+			if (z1 != z2)
+				return z1 > z2;
+			for (int i = 0; i < 3; i++){
+				if (t1.p[i].x != t2.p[i].x) return t1.p[i].x < t2.p[i].x;
+				if (t1.p[i].y != t2.p[i].y) return t1.p[i].y < t2.p[i].y;
+			}
+			return t1.col < t2.col;
+		});
+
+
+		// Loop through all transformed, viewed, projected, and sorted triangles
+		// Clip triangles against all four screen edges and normalise to OpenGL screen coordinates
+		for (auto &triToRaster : vecTrianglesToClip){
+			// Clip triangles against all four screen edges, this could yield
+			// a bunch of triangles, so create a queue that we traverse to
+			//  ensure we only test new triangles generated against planes
+			Triangle clipped[2];
+			listTriangles.clear();
+
+			// Add initial Triangle
+			listTriangles.push_back(triToRaster);
+			int nNewTriangles = 1;
+
+			for (int p = 0; p < 4; p++){
+				int nTrisToAdd = 0;
+				while (nNewTriangles > 0){
+					// Take Triangle from front of queue
+					Triangle test = listTriangles.front();
+					listTriangles.pop_front();
+					nNewTriangles--;
+
+					// Clip it against a plane. We only need to test each
+					// subsequent plane, against subsequent new triangles
+					// as all triangles after a plane clip are guaranteed
+					// to lie on the inside of the plane. I like how this
+					// comment is almost completely and utterly justified
+					switch (p)
+					{
+					case 0:	nTrisToAdd = Triangle_ClipAgainstPlane({ 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, test, clipped[0], clipped[1]); break;
+					case 1:	nTrisToAdd = Triangle_ClipAgainstPlane({ 0.0f, (float)height - 1, 0.0f }, { 0.0f, -1.0f, 0.0f }, test, clipped[0], clipped[1]); break;
+					case 2:	nTrisToAdd = Triangle_ClipAgainstPlane({ 0.0f, 0.0f, 0.0f }, { 1.0f, 0.0f, 0.0f }, test, clipped[0], clipped[1]); break;
+					case 3:	nTrisToAdd = Triangle_ClipAgainstPlane({ (float)width - 1, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f }, test, clipped[0], clipped[1]); break;
+					}
+
+					// Clipping may yield a variable number of triangles, so
+					// add these new ones to the back of the queue for subsequent
+					// clipping against next planes
+					for (int w = 0; w < nTrisToAdd; w++)
+						listTriangles.push_back(clipped[w]);
+				}
+				nNewTriangles = listTriangles.size();
+			}
+
+
+			// Draw the transformed, viewed, clipped, projected, sorted, clipped triangles
+			for (auto &t : listTriangles){
+				// normalise to screen and push to draw list
+				for(int i = 0; i < 3; i++){
+					t.p[i].x = (t.p[i].x / (width / 2)) - 1;
+					t.p[i].y = (t.p[i].y / (height / 2)) - 1;
+				}
+
+				std::array<float, 9> point{t.p[0].x, t.p[0].y, 0.0f, t.p[1].x, t.p[1].y, 0.0f, t.p[2].x, t.p[2].y, 0.0f};
+				out.triangles.push_back(point);
+				out.colours.push_back(t.col);
+			}
+		}
+	}
+
+	// Convenience for the common case of drawing one whole mesh
+	void Render(Camera &camera, const Mesh &mesh, DrawList &out){
+		Begin(camera);
+		Submit(mesh.tris.data(), mesh.tris.size());
+		End(out);
+	}
+
+private:
+	Mat4 matWorld;
+	Mat4 matView;
+	Vec3d cameraPos;
+
+	// Scratch storage kept between frames so it is not reallocated every frame
+	TrackedVector<Triangle, MemTag::ClipScratch> vecTrianglesToClip;
+	TrackedList<Triangle, MemTag::ClipScratch> listTriangles;
+};
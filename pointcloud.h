@@ -0,0 +1,214 @@
+#pragma once
+
+#include "pipeline.h"
+
+#include <cstdlib>
+#include <cstdint>
+
+// A position with no w term, point clouds can have millions of these
+class Point3 {
+public:
+	float x = 0;
+	float y = 0;
+	float z = 0;
+};
+
+
+// Vertices of an obj file with few or no faces, such as scan data. Any faces are ignored.
+// Points are stored in a preview order: sorted along a Morton (Z order) curve and then visited
+// in bit reversed order, so any prefix of the array is spread evenly over the whole cloud
+class PointCloud {
+public:
+	TrackedVector<Point3, MemTag::Mesh> points;
+	Vec3d boundsMin;
+	Vec3d boundsMax;
+
+	bool LoadFromObjectFile(std::string sFilename){
+		std::ifstream f(sFilename);
+		if (!f.is_open())
+			return false;
+
+		points.clear();
+
+		// Only "v x y z" lines, other lines including "vn" and "vt" are skipped
+		std::string line;
+		while (std::getline(f, line)){
+			if (line.size() < 2 || line[0] != 'v' || line[1] != ' ')
+				continue;
+
+			const char *s = line.c_str() + 2;
+			char *end;
+			Point3 p;
+			p.x = strtof(s, &end); s = end;
+			p.y = strtof(s, &end); s = end;
+			p.z = strtof(s, &end);
+			points.push_back(p);
+		}
+
+		SortForPreview();
+		return true;
+	}
+
+	// Count the "v" and "f" lines of an obj file without parsing them, far cheaper than
+	// loading it, so the viewer can pick a loader before reading the file properly
+	static bool CountObjElements(const std::string &sFilename, size_t &nVerts, size_t &nFaces){
+		nVerts = 0;
+		nFaces = 0;
+		std::ifstream f(sFilename);
+		if (!f.is_open())
+			return false;
+
+		std::string line;
+		while (std::getline(f, line)){
+			if (line.size() < 2 || line[1] != ' ')
+				continue;
+			if (line[0] == 'v')
+				nVerts++;
+			else if (line[0] == 'f')
+				nFaces++;
+		}
+		return true;
+	}
+
+private:
+	// Spread the lower 10 bits of v so there are two zero bits between each
+	static uint32_t SpreadBits(uint32_t v){
+		v &= 0x3FF;
+		v = (v | (v << 16)) & 0x030000FF;
+		v = (v | (v << 8)) & 0x0300F00F;
+		v = (v | (v << 4)) & 0x030C30C3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	}
+
+	static uint32_t ReverseBits(uint32_t v, int nBits){
+		uint32_t r = 0;
+		for (int i = 0; i < nBits; i++){
+			r = (r << 1) | (v & 1);
+			v >>= 1;
+		}
+		return r;
+	}
+
+	void SortForPreview(){
+		if (points.empty())
+			return;
+
+		boundsMin = Vec3d(points[0].x, points[0].y, points[0].z);
+		boundsMax = boundsMin;
+		for (auto &p : points){
+			boundsMin.x = std::min(boundsMin.x, p.x); boundsMax.x = std::max(boundsMax.x, p.x);
+			boundsMin.y = std::min(boundsMin.y, p.y); boundsMax.y = std::max(boundsMax.y, p.y);
+			boundsMin.z = std::min(boundsMin.z, p.z); boundsMax.z = std::max(boundsMax.z, p.z);
+		}
+
+		// Morton code of each point on a 1024^3 grid over the bounds
+		Vec3d size = boundsMax - boundsMin;
+		float scale = 1023.0f / std::max({ size.x, size.y, size.z, 1e-6f });
+
+		TrackedVector<std::pair<uint32_t, uint32_t>, MemTag::LoaderScratch> keys(points.size());
+		for (size_t i = 0; i < points.size(); i++){
+			uint32_t qx = (uint32_t)((points[i].x - boundsMin.x) * scale);
+			uint32_t qy = (uint32_t)((points[i].y - boundsMin.y) * scale);
+			uint32_t qz = (uint32_t)((points[i].z - boundsMin.z) * scale);
+			keys[i] = { SpreadBits(qx) | (SpreadBits(qy) << 1) | (SpreadBits(qz) << 2), (uint32_t)i };
+		}
+		std::sort(keys.begin(), keys.end());
+
+		// Visiting the sorted order by bit reversed index takes every half, then every quarter
+		// and so on of the curve, which gives an evenly spaced subset at every prefix length
+		int nBits = 0;
+		while (((size_t)1 << nBits) < points.size())
+			nBits++;
+
+		TrackedVector<Point3, MemTag::Mesh> ordered;
+		ordered.reserve(points.size());
+		for (uint32_t i = 0; i < ((uint32_t)1 << nBits); i++){
+			uint32_t r = ReverseBits(i, nBits);
+			if (r < points.size())
+				ordered.push_back(points[keys[r].second]);
+		}
+		points.swap(ordered);
+	}
+};
+
+
+// Draws a point cloud as depth tested screen space splats.
+// While the camera moves each frame shows a fixed budget prefix of the cloud. Once it stops,
+// every following frame projects the next budget of points and keeps the earlier ones,
+// so the view refines until all points are drawn
+class PointSplatter {
+public:
+	size_t pointsPerFrame = 250000;
+
+	// Normalised device coordinates with depth, and a grey level per point
+	TrackedVector<float, MemTag::DrawLists> vertices;
+	TrackedVector<float, MemTag::DrawLists> colours;
+
+	// Project the points needed for this frame, returns the number of points ready to draw
+	size_t Update(Camera &camera, const Mat4 &matProj, const PointCloud &cloud){
+		if (!bHaveCamera || camera.pos.x != lastPos.x || camera.pos.y != lastPos.y || camera.pos.z != lastPos.z
+			|| camera.fYaw != lastYaw || camera.fPitch != lastPitch){
+			// View changed, start again from the preview prefix
+			nProjected = 0;
+			vertices.clear();
+			colours.clear();
+			lastPos = camera.pos;
+			lastYaw = camera.fYaw;
+			lastPitch = camera.fPitch;
+			bHaveCamera = true;
+		}
+
+		size_t nEnd = std::min(cloud.points.size(), nProjected + pointsPerFrame);
+		if (nEnd > nProjected){
+			Mat4 matView = camera.matView();
+			Mat4 proj = matProj;
+
+			// Shade by distance over the size of the cloud
+			Vec3d boundsMax = cloud.boundsMax;
+			Vec3d extent = boundsMax - cloud.boundsMin;
+			float range = std::max(1e-6f, extent.vec_length(extent));
+
+			for (size_t i = nProjected; i < nEnd; i++){
+				const Point3 &p = cloud.points[i];
+				Vec3d viewed = matView * Vec3d(p.x, p.y, p.z);
+
+				// Near plane, same as the triangle path
+				if (viewed.z < 0.1f)
+					continue;
+
+				Vec3d projected = proj * viewed;
+				projected = projected / projected.w;
+
+				// X is inverted, as in the triangle path
+				float x = -projected.x;
+				float y = projected.y;
+				if (x < -1.0f || x > 1.0f || y < -1.0f || y > 1.0f || projected.z > 1.0f)
+					continue;
+
+				vertices.push_back(x);
+				vertices.push_back(y);
+				vertices.push_back(projected.z * 2.0f - 1.0f);
+
+				float grey = 0.15f + 0.6f * std::min(1.0f, viewed.z / range);
+				colours.push_back(grey);
+				colours.push_back(grey);
+				colours.push_back(grey);
+			}
+			nProjected = nEnd;
+		}
+		return vertices.size() / 3;
+	}
+
+	// Fraction of the cloud that has been considered for the current view
+	float Progress(const PointCloud &cloud) const {
+		return cloud.points.empty() ? 1.0f : (float)nProjected / cloud.points.size();
+	}
+
+private:
+	size_t nProjected = 0;
+	bool bHaveCamera = false;
+	Vec3d lastPos;
+	float lastYaw = 0;
+	float lastPitch = 0;
+};
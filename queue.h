@@ -0,0 +1,72 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+// A fixed capacity queue shared between threads. Push blocks while full and Pop blocks
+// while empty, so a fast producer cannot run ahead of its consumers and use unbounded memory
+template <typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+	// Returns false if the queue was closed
+	bool Push(T item){
+		std::unique_lock<std::mutex> lock(mtx);
+		notFull.wait(lock, [&]{ return items.size() < capacity || closed; });
+		if (closed)
+			return false;
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	// Non blocking push, returns false if the queue is full or closed
+	bool TryPush(T item){
+		std::lock_guard<std::mutex> lock(mtx);
+		if (closed || items.size() >= capacity)
+			return false;
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	// Returns false once the queue is closed and drained
+	bool Pop(T &item){
+		std::unique_lock<std::mutex> lock(mtx);
+		notEmpty.wait(lock, [&]{ return !items.empty() || closed; });
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	// Non blocking pop, returns false if the queue is empty
+	bool TryPop(T &item){
+		std::lock_guard<std::mutex> lock(mtx);
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	void Close(){
+		std::lock_guard<std::mutex> lock(mtx);
+		closed = true;
+		notEmpty.notify_all();
+		notFull.notify_all();
+	}
+
+private:
+	size_t capacity;
+	std::deque<T> items;
+	bool closed = false;
+	std::mutex mtx;
+	std::condition_variable notEmpty;
+	std::condition_variable notFull;
+};
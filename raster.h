@@ -0,0 +1,198 @@
+#pragma once
+
+#include "pipeline.h"
+
+#include <cstdint>
+#include <cstdio>
+
+// A CPU side RGB image, row 0 is the top of the picture
+class FrameBuffer {
+public:
+	int width = 0;
+	int height = 0;
+	TrackedVector<uint8_t, MemTag::FrameBuffers> pixels;	// width * height * 3 bytes
+
+	FrameBuffer() = default;
+	FrameBuffer(int w, int h) : width(w), height(h), pixels((size_t)w * h * 3) {}
+
+	void Clear(uint8_t r, uint8_t g, uint8_t b){
+		for (size_t i = 0; i < pixels.size(); i += 3){
+			pixels[i] = r;
+			pixels[i + 1] = g;
+			pixels[i + 2] = b;
+		}
+	}
+
+	// Fill a single triangle given in pixel coordinates with a grey level
+	void FillTriangle(float x0, float y0, float x1, float y1, float x2, float y2, uint8_t grey){
+		// Edge function, positive when p is to the left of a->b
+		auto edge = [](float ax, float ay, float bx, float by, float px, float py){
+			return (bx - ax) * (py - ay) - (by - ay) * (px - ax);
+		};
+
+		float area = edge(x0, y0, x1, y1, x2, y2);
+		if (area == 0.0f)
+			return;
+
+		// Bounding box clamped to the image
+		int minX = std::max(0, (int)std::floor(std::min({ x0, x1, x2 })));
+		int maxX = std::min(width - 1, (int)std::ceil(std::max({ x0, x1, x2 })));
+		int minY = std::max(0, (int)std::floor(std::min({ y0, y1, y2 })));
+		int maxY = std::min(height - 1, (int)std::ceil(std::max({ y0, y1, y2 })));
+
+		for (int y = minY; y <= maxY; y++){
+			float py = y + 0.5f;
+			uint8_t *row = &pixels[(size_t)y * width * 3];
+			for (int x = minX; x <= maxX; x++){
+				float px = x + 0.5f;
+				float w0 = edge(x1, y1, x2, y2, px, py);
+				float w1 = edge(x2, y2, x0, y0, px, py);
+				float w2 = edge(x0, y0, x1, y1, px, py);
+
+				// Accept either winding, the pipeline has already done backface culling
+				bool inside = area > 0 ? (w0 >= 0 && w1 >= 0 && w2 >= 0) : (w0 <= 0 && w1 <= 0 && w2 <= 0);
+				if (inside){
+					row[x * 3] = grey;
+					row[x * 3 + 1] = grey;
+					row[x * 3 + 2] = grey;
+				}
+			}
+		}
+	}
+
+	// Rasterise a draw list in order (it is already sorted back to front)
+	void Draw(const DrawList &list){
+		for (size_t i = 0; i < list.triangles.size(); i++){
+			const std::array<float, 9> &t = list.triangles[i];
+
+			// Normalised device coordinates to pixels, flipping y as OpenGL has its origin at the bottom
+			float sx[3], sy[3];
+			for (int v = 0; v < 3; v++){
+				sx[v] = (t[v * 3] + 1.0f) * 0.5f * width;
+				sy[v] = (1.0f - t[v * 3 + 1]) * 0.5f * height;
+			}
+
+			float c = std::min(1.0f, std::max(0.0f, list.colours[i]));
+			FillTriangle(sx[0], sy[0], sx[1], sy[1], sx[2], sy[2], (uint8_t)(c * 255.0f));
+		}
+	}
+};
+
+
+// Image file writers for frame buffers
+namespace ImageWriter {
+
+	inline bool WritePPM(const std::string &sFilename, const FrameBuffer &fb){
+		std::ofstream f(sFilename, std::ios::binary);
+		if (!f.is_open())
+			return false;
+
+		f << "P6\n" << fb.width << " " << fb.height << "\n255\n";
+		f.write((const char*)fb.pixels.data(), fb.pixels.size());
+		return f.good();
+	}
+
+	inline uint32_t Crc32(uint32_t crc, const uint8_t *data, size_t len){
+		static uint32_t table[256];
+		static bool bTableReady = [](){
+			for (uint32_t n = 0; n < 256; n++){
+				uint32_t c = n;
+				for (int k = 0; k < 8; k++)
+					c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				table[n] = c;
+			}
+			return true;
+		}();
+		(void)bTableReady;
+
+		crc = ~crc;
+		for (size_t i = 0; i < len; i++)
+			crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	// PNG with uncompressed (stored) deflate blocks. Larger than a compressed file but
+	// needs no zlib and costs almost nothing to produce, which matters for batch output
+	inline bool WritePNG(const std::string &sFilename, const FrameBuffer &fb){
+		std::ofstream f(sFilename, std::ios::binary);
+		if (!f.is_open())
+			return false;
+
+		auto put32 = [](std::vector<uint8_t> &v, uint32_t x){
+			v.push_back((x >> 24) & 0xFF);
+			v.push_back((x >> 16) & 0xFF);
+			v.push_back((x >> 8) & 0xFF);
+			v.push_back(x & 0xFF);
+		};
+
+		auto writeChunk = [&](const char *type, const std::vector<uint8_t> &data){
+			std::vector<uint8_t> chunk;
+			put32(chunk, (uint32_t)data.size());
+			chunk.insert(chunk.end(), type, type + 4);
+			chunk.insert(chunk.end(), data.begin(), data.end());
+			uint32_t crc = Crc32(0, chunk.data() + 4, chunk.size() - 4);
+			put32(chunk, crc);
+			f.write((const char*)chunk.data(), chunk.size());
+		};
+
+		static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+		f.write((const char*)signature, 8);
+
+		std::vector<uint8_t> ihdr;
+		put32(ihdr, fb.width);
+		put32(ihdr, fb.height);
+		ihdr.push_back(8);	// bit depth
+		ihdr.push_back(2);	// colour type RGB
+		ihdr.push_back(0);	// compression
+		ihdr.push_back(0);	// filter
+		ihdr.push_back(0);	// interlace
+		writeChunk("IHDR", ihdr);
+
+		// Raw scanlines, each prefixed with filter type 0
+		size_t rowBytes = (size_t)fb.width * 3;
+		size_t rawSize = (rowBytes + 1) * fb.height;
+
+		std::vector<uint8_t> idat;
+		idat.reserve(rawSize + rawSize / 65535 * 5 + 16);
+		idat.push_back(0x78);	// zlib header, no compression
+		idat.push_back(0x01);
+
+		uint32_t adlerA = 1, adlerB = 0;
+		size_t remaining = rawSize;
+		size_t blockLeft = 0;
+		for (int y = 0; y < fb.height; y++){
+			const uint8_t *row = &fb.pixels[y * rowBytes];
+			for (size_t i = 0; i <= rowBytes; i++){
+				// Start a new stored block every 65535 bytes
+				if (blockLeft == 0){
+					size_t len = std::min<size_t>(remaining, 65535);
+					idat.push_back(remaining <= 65535 ? 1 : 0);
+					idat.push_back(len & 0xFF);
+					idat.push_back((len >> 8) & 0xFF);
+					idat.push_back(~len & 0xFF);
+					idat.push_back((~len >> 8) & 0xFF);
+					blockLeft = len;
+				}
+
+				uint8_t b = (i == 0) ? 0 : row[i - 1];
+				idat.push_back(b);
+				adlerA = (adlerA + b) % 65521;
+				adlerB = (adlerB + adlerA) % 65521;
+				blockLeft--;
+				remaining--;
+			}
+		}
+		put32(idat, (adlerB << 16) | adlerA);
+		writeChunk("IDAT", idat);
+		writeChunk("IEND", {});
+
+		return f.good();
+	}
+
+	// Pick the writer from the file extension, ".ppm" or ".png"
+	inline bool Write(const std::string &sFilename, const FrameBuffer &fb){
+		if (sFilename.size() >= 4 && sFilename.compare(sFilename.size() - 4, 4, ".ppm") == 0)
+			return WritePPM(sFilename, fb);
+		return WritePNG(sFilename, fb);
+	}
+}
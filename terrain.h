@@ -0,0 +1,437 @@
+#pragma once
+
+#include "pipeline.h"
+
+#include <cstdint>
+
+// A regular grid of heights, sample (i, j) is at x0 + i * spacing, z0 + j * spacing
+class Heightfield {
+public:
+	int nx = 0;
+	int nz = 0;
+	float x0 = 0;
+	float z0 = 0;
+	float spacing = 1;
+	TrackedVector<float, MemTag::Mesh> heights;
+
+	float at(int i, int j) const {
+		return heights[(size_t)j * nx + i];
+	}
+
+	// A mesh is treated as a heightfield if it is single valued over the XZ plane, that is all
+	// face normals point the same way up or down. A few near vertical faces (cliffs) are allowed.
+	// The faces are then resampled onto a regular grid of about the same density
+	static bool FromMesh(const Mesh &mesh, Heightfield &out){
+		if (mesh.tris.size() < 2)
+			return false;
+
+		int nUp = 0, nDown = 0, nSteep = 0;
+		Vec3d boundsMin = mesh.tris[0].p[0];
+		Vec3d boundsMax = boundsMin;
+		for (auto &tri : mesh.tris){
+			Triangle t = tri;
+			Vec3d line1 = t.p[1] - t.p[0];
+			Vec3d line2 = t.p[2] - t.p[0];
+			Vec3d normal = line1.cross_product(line2);
+			float len = normal.vec_length(normal);
+			if (len == 0.0f)
+				continue;
+			if (normal.y > 0.05f * len) nUp++;
+			else if (normal.y < -0.05f * len) nDown++;
+			else nSteep++;
+
+			for (int i = 0; i < 3; i++){
+				boundsMin.x = std::min(boundsMin.x, t.p[i].x); boundsMax.x = std::max(boundsMax.x, t.p[i].x);
+				boundsMin.y = std::min(boundsMin.y, t.p[i].y); boundsMax.y = std::max(boundsMax.y, t.p[i].y);
+				boundsMin.z = std::min(boundsMin.z, t.p[i].z); boundsMax.z = std::max(boundsMax.z, t.p[i].z);
+			}
+		}
+		if ((nUp > 0 && nDown > 0) || nSteep * 50 > (int)mesh.tris.size())
+			return false;
+
+		float width = boundsMax.x - boundsMin.x;
+		float depth = boundsMax.z - boundsMin.z;
+		if (width <= 0.0f || depth <= 0.0f)
+			return false;
+
+		// Two grid triangles per source triangle
+		out.spacing = sqrtf(2.0f * width * depth / mesh.tris.size());
+		out.x0 = boundsMin.x;
+		out.z0 = boundsMin.z;
+		out.nx = (int)ceilf(width / out.spacing) + 1;
+		out.nz = (int)ceilf(depth / out.spacing) + 1;
+		out.heights.assign((size_t)out.nx * out.nz, 0.0f);
+
+		TrackedVector<uint8_t, MemTag::LoaderScratch> covered((size_t)out.nx * out.nz, 0);
+
+		// Rasterise each face onto the grid in XZ, interpolating its heights
+		for (auto &t : mesh.tris){
+			float ax = t.p[0].x, az = t.p[0].z;
+			float bx = t.p[1].x, bz = t.p[1].z;
+			float cx = t.p[2].x, cz = t.p[2].z;
+			float area = (bx - ax) * (cz - az) - (bz - az) * (cx - ax);
+			if (area == 0.0f)
+				continue;
+
+			int iMin = std::max(0, (int)floorf((std::min({ ax, bx, cx }) - out.x0) / out.spacing));
+			int iMax = std::min(out.nx - 1, (int)ceilf((std::max({ ax, bx, cx }) - out.x0) / out.spacing));
+			int jMin = std::max(0, (int)floorf((std::min({ az, bz, cz }) - out.z0) / out.spacing));
+			int jMax = std::min(out.nz - 1, (int)ceilf((std::max({ az, bz, cz }) - out.z0) / out.spacing));
+
+			for (int j = jMin; j <= jMax; j++){
+				for (int i = iMin; i <= iMax; i++){
+					float px = out.x0 + i * out.spacing;
+					float pz = out.z0 + j * out.spacing;
+					float w0 = ((bx - px) * (cz - pz) - (bz - pz) * (cx - px)) / area;
+					float w1 = ((cx - px) * (az - pz) - (cz - pz) * (ax - px)) / area;
+					float w2 = 1.0f - w0 - w1;
+					const float eps = -1e-4f;
+					if (w0 >= eps && w1 >= eps && w2 >= eps){
+						size_t k = (size_t)j * out.nx + i;
+						out.heights[k] = w0 * t.p[0].y + w1 * t.p[1].y + w2 * t.p[2].y;
+						covered[k] = 1;
+					}
+				}
+			}
+		}
+
+		out.FillHoles(covered);
+		return true;
+	}
+
+	// Binary (P5) or text (P2) greymap, 8 or 16 bit. Values are scaled to 0..fMaxHeight
+	bool LoadFromPGM(std::string sFilename, float fSpacing, float fMaxHeight){
+		std::ifstream f(sFilename, std::ios::binary);
+		if (!f.is_open())
+			return false;
+
+		// Header fields may be separated by comments
+		auto next = [&](int &value){
+			f >> std::ws;
+			while (f.peek() == '#'){
+				std::string comment;
+				std::getline(f, comment);
+				f >> std::ws;
+			}
+			return (bool)(f >> value);
+		};
+
+		std::string magic;
+		f >> magic;
+		int maxValue = 0;
+		if ((magic != "P5" && magic != "P2") || !next(nx) || !next(nz) || !next(maxValue) || nx < 2 || nz < 2 || maxValue <= 0)
+			return false;
+
+		heights.assign((size_t)nx * nz, 0.0f);
+		spacing = fSpacing;
+		x0 = -0.5f * (nx - 1) * spacing;
+		z0 = -0.5f * (nz - 1) * spacing;
+
+		if (magic == "P5"){
+			f.get();	// single whitespace before the data
+			int bytes = maxValue > 255 ? 2 : 1;
+			std::vector<uint8_t> row((size_t)nx * bytes);
+			for (int j = 0; j < nz; j++){
+				if (!f.read((char*)row.data(), row.size()))
+					return false;
+				for (int i = 0; i < nx; i++){
+					int v = bytes == 2 ? (row[i * 2] << 8) | row[i * 2 + 1] : row[i];
+					heights[(size_t)j * nx + i] = fMaxHeight * v / maxValue;
+				}
+			}
+		} else {
+			for (size_t k = 0; k < heights.size(); k++){
+				int v;
+				if (!next(v))
+					return false;
+				heights[k] = fMaxHeight * v / maxValue;
+			}
+		}
+		return true;
+	}
+
+private:
+	// Give samples outside the source mesh the height of the nearest covered sample,
+	// found by growing the covered area one ring at a time
+	void FillHoles(TrackedVector<uint8_t, MemTag::LoaderScratch> &covered){
+		bool bAny = false;
+		for (auto c : covered) bAny |= c != 0;
+		if (!bAny)
+			return;
+
+		TrackedVector<size_t, MemTag::LoaderScratch> frontier;
+		for (size_t k = 0; k < covered.size(); k++)
+			if (covered[k]) frontier.push_back(k);
+
+		TrackedVector<size_t, MemTag::LoaderScratch> nextFrontier;
+		while (!frontier.empty()){
+			nextFrontier.clear();
+			for (size_t k : frontier){
+				int i = (int)(k % nx), j = (int)(k / nx);
+				const int di[4] = { 1, -1, 0, 0 };
+				const int dj[4] = { 0, 0, 1, -1 };
+				for (int n = 0; n < 4; n++){
+					int ni = i + di[n], nj = j + dj[n];
+					if (ni < 0 || nj < 0 || ni >= nx || nj >= nz)
+						continue;
+					size_t nk = (size_t)nj * nx + ni;
+					if (!covered[nk]){
+						covered[nk] = 1;
+						heights[nk] = heights[k];
+						nextFrontier.push_back(nk);
+					}
+				}
+			}
+			frontier.swap(nextFrontier);
+		}
+	}
+};
+
+
+// Chunked level of detail terrain.
+// The heightfield is split into square tiles with precomputed height bounds. Each frame only
+// tiles inside the view distance and the frustum are drawn, and each tile picks a grid step of
+// 1, 2, 4... samples from rings of doubling distance around the camera. Vertices blend their
+// height towards the next coarser level over the outer part of each ring (geomorphing), so a
+// tile is exactly the coarser surface where it meets a coarser neighbour and there are no cracks
+class Terrain {
+public:
+	static const int tileQuads = 16;	// Quads along a tile side at the finest level, a power of 2
+	static const int nLevels = 5;		// Grid steps 1, 2, 4, 8, 16
+
+	Heightfield field;
+
+	class Tile {
+	public:
+		int i0 = 0;
+		int j0 = 0;
+		float minHeight = 0;
+		float maxHeight = 0;
+	};
+	std::vector<Tile> tiles;
+	int tilesX = 0;
+	int tilesZ = 0;
+
+	int nTilesDrawn = 0;	// Statistics for the last Generate
+	int nTilesCulled = 0;
+
+	void Build(Heightfield &&hf){
+		field = std::move(hf);
+
+		// Pad the grid out to a whole number of tiles
+		tilesX = std::max(1, (field.nx - 1 + tileQuads - 1) / tileQuads);
+		tilesZ = std::max(1, (field.nz - 1 + tileQuads - 1) / tileQuads);
+		int nx = tilesX * tileQuads + 1;
+		int nz = tilesZ * tileQuads + 1;
+		if (nx != field.nx || nz != field.nz){
+			TrackedVector<float, MemTag::Mesh> padded((size_t)nx * nz);
+			for (int j = 0; j < nz; j++)
+				for (int i = 0; i < nx; i++)
+					padded[(size_t)j * nx + i] = field.at(std::min(i, field.nx - 1), std::min(j, field.nz - 1));
+			field.heights.swap(padded);
+			field.nx = nx;
+			field.nz = nz;
+		}
+
+		tiles.resize((size_t)tilesX * tilesZ);
+		for (int tz = 0; tz < tilesZ; tz++){
+			for (int tx = 0; tx < tilesX; tx++){
+				Tile &tile = tiles[(size_t)tz * tilesX + tx];
+				tile.i0 = tx * tileQuads;
+				tile.j0 = tz * tileQuads;
+				tile.minHeight = tile.maxHeight = field.at(tile.i0, tile.j0);
+				for (int j = 0; j <= tileQuads; j++){
+					for (int i = 0; i <= tileQuads; i++){
+						float h = field.at(tile.i0 + i, tile.j0 + j);
+						tile.minHeight = std::min(tile.minHeight, h);
+						tile.maxHeight = std::max(tile.maxHeight, h);
+					}
+				}
+			}
+		}
+
+		// Each ring must be wider than a tile diagonal so neighbouring tiles differ by at most one
+		// level, and morphing must finish a tile diagonal inside the ring so a finer neighbour
+		// never sees this tile's vertices move further towards the next level
+		float tileSize = tileQuads * field.spacing;
+		float maxRise = 0.0f;
+		for (auto &tile : tiles)
+			maxRise = std::max(maxRise, tile.maxHeight - tile.minHeight);
+		float tileDiag = sqrtf(2.0f * tileSize * tileSize + maxRise * maxRise);
+		for (int l = 0; l < nLevels; l++){
+			rangeEnd[l] = 1.5f * tileDiag * (float)(1 << l);
+			morphStart[l] = rangeEnd[l] - 0.3f * (rangeEnd[l] - (l > 0 ? rangeEnd[l - 1] : 0.0f));
+		}
+
+		// The coarsest ring ends at the view distance and never goes past the far plane.
+		// It has no coarser level to morph towards, MorphedVertex leaves it alone
+		viewDistance = std::min(rangeEnd[nLevels - 1], Pipeline::fFar);
+		rangeEnd[nLevels - 1] = viewDistance;
+		morphStart[nLevels - 1] = viewDistance;
+	}
+
+	// Append world space triangles for every visible tile to out
+	template <typename Container>
+	void Generate(const Vec3d &cameraPos, const Frustum &frustum, Container &out){
+		nTilesDrawn = 0;
+		nTilesCulled = 0;
+
+		// Only tiles within the view distance are considered, so the cost does not depend on
+		// the size of the whole terrain
+		float tileSize = tileQuads * field.spacing;
+		int txMin = std::max(0, (int)floorf((cameraPos.x - viewDistance - field.x0) / tileSize));
+		int txMax = std::min(tilesX - 1, (int)floorf((cameraPos.x + viewDistance - field.x0) / tileSize));
+		int tzMin = std::max(0, (int)floorf((cameraPos.z - viewDistance - field.z0) / tileSize));
+		int tzMax = std::min(tilesZ - 1, (int)floorf((cameraPos.z + viewDistance - field.z0) / tileSize));
+
+		for (int tz = tzMin; tz <= tzMax; tz++){
+			for (int tx = txMin; tx <= txMax; tx++){
+				const Tile &tile = tiles[(size_t)tz * tilesX + tx];
+
+				Vec3d boxMin, boxMax;
+				int level = TileLevel(tile, cameraPos, boxMin, boxMax);
+				if (level < 0 || !frustum.intersectsBox(boxMin, boxMax)){
+					nTilesCulled++;
+					continue;
+				}
+
+				EmitTile(tile, level, cameraPos, out);
+				nTilesDrawn++;
+			}
+		}
+	}
+
+	// Compare the surfaces of neighbouring tiles along every shared edge within the view
+	// distance at each sample, for --bench. Returns the number of samples where they differ
+	// by more than rounding, and the largest difference in maxGap
+	size_t CountSeamGaps(const Vec3d &cameraPos, float &maxGap){
+		size_t nGaps = 0;
+		maxGap = 0.0f;
+		for (int tz = 0; tz < tilesZ; tz++){
+			for (int tx = 0; tx < tilesX; tx++){
+				Vec3d boxMin, boxMax;
+				const Tile &tile = tiles[(size_t)tz * tilesX + tx];
+				int level = TileLevel(tile, cameraPos, boxMin, boxMax);
+				if (level < 0)
+					continue;
+
+				// The neighbours at +x and +z, each edge is checked once
+				for (int side = 0; side < 2; side++){
+					int nx = tx + (side == 0), nz = tz + (side == 1);
+					if (nx >= tilesX || nz >= tilesZ)
+						continue;
+					const Tile &next = tiles[(size_t)nz * tilesX + nx];
+					int nextLevel = TileLevel(next, cameraPos, boxMin, boxMax);
+					if (nextLevel < 0)
+						continue;
+
+					for (int k = 0; k <= tileQuads; k++){
+						int i = side == 0 ? next.i0 : next.i0 + k;
+						int j = side == 0 ? next.j0 + k : next.j0;
+						float h = EdgeHeight(i, j, side, level, cameraPos);
+						float hNext = EdgeHeight(i, j, side, nextLevel, cameraPos);
+						float gap = fabsf(h - hNext);
+						maxGap = std::max(maxGap, gap);
+						if (gap > 1e-4f * (1.0f + fabsf(h)))
+							nGaps++;
+					}
+				}
+			}
+		}
+		return nGaps;
+	}
+
+private:
+	float rangeEnd[nLevels];
+	float morphStart[nLevels];
+	float viewDistance = 0;
+
+	// Level a tile is drawn at from cameraPos, or -1 if it is past the view distance
+	int TileLevel(const Tile &tile, const Vec3d &cameraPos, Vec3d &boxMin, Vec3d &boxMax){
+		float tileSize = tileQuads * field.spacing;
+		boxMin = Vec3d(field.x0 + tile.i0 * field.spacing, tile.minHeight, field.z0 + tile.j0 * field.spacing);
+		boxMax = Vec3d(boxMin.x + tileSize, tile.maxHeight, boxMin.z + tileSize);
+
+		float dMin = DistanceToBox(cameraPos, boxMin, boxMax);
+		if (dMin > viewDistance)
+			return -1;
+
+		int level = 0;
+		while (level < nLevels - 1 && dMin >= rangeEnd[level])
+			level++;
+		return level;
+	}
+
+	// Height at sample (i, j) of the edge of a tile drawn at level, interpolated between the
+	// vertices of that level. side 0 is an edge along z, side 1 an edge along x
+	float EdgeHeight(int i, int j, int side, int level, const Vec3d &cameraPos){
+		int step = 1 << level;
+		int along = side == 0 ? j : i;
+		int a = along - along % step;
+		float t = (float)(along - a) / step;
+		float h0 = side == 0 ? MorphedVertex(i, a, step, level, cameraPos).y : MorphedVertex(a, j, step, level, cameraPos).y;
+		if (t == 0.0f)
+			return h0;
+		float h1 = side == 0 ? MorphedVertex(i, a + step, step, level, cameraPos).y : MorphedVertex(a + step, j, step, level, cameraPos).y;
+		return h0 + (h1 - h0) * t;
+	}
+
+	static float DistanceToBox(const Vec3d &p, const Vec3d &boxMin, const Vec3d &boxMax){
+		float dx = std::max({ boxMin.x - p.x, 0.0f, p.x - boxMax.x });
+		float dy = std::max({ boxMin.y - p.y, 0.0f, p.y - boxMax.y });
+		float dz = std::max({ boxMin.z - p.z, 0.0f, p.z - boxMax.z });
+		return sqrtf(dx * dx + dy * dy + dz * dz);
+	}
+
+	// World position of grid sample (i, j) in a tile drawn with the given step, morphed
+	// towards the surface of the next coarser step
+	Vec3d MorphedVertex(int i, int j, int step, int level, const Vec3d &cameraPos){
+		Vec3d v(field.x0 + i * field.spacing, field.at(i, j), field.z0 + j * field.spacing);
+
+		// Samples on the coarser grid do not move, nor does the coarsest level
+		int coarse = step * 2;
+		bool bOddI = (i % coarse) != 0;
+		bool bOddJ = (j % coarse) != 0;
+		if ((!bOddI && !bOddJ) || level == nLevels - 1)
+			return v;
+
+		float dx = v.x - cameraPos.x, dy = v.y - cameraPos.y, dz = v.z - cameraPos.z;
+		float d = sqrtf(dx * dx + dy * dy + dz * dz);
+		float morph = (d - morphStart[level]) / (rangeEnd[level] - morphStart[level]);
+		if (morph <= 0.0f)
+			return v;
+		morph = std::min(morph, 1.0f);
+
+		// Height of the coarser surface here, the midpoint of the coarse edge or diagonal
+		// this sample lies on. Diagonals run from (i, j) to (i + 1, j + 1) as in EmitTile
+		int di = bOddI ? step : 0;
+		int dj = bOddJ ? step : 0;
+		float target = 0.5f * (field.at(i - di, j - dj) + field.at(std::min(i + di, field.nx - 1), std::min(j + dj, field.nz - 1)));
+		v.y += (target - v.y) * morph;
+		return v;
+	}
+
+	template <typename Container>
+	void EmitTile(const Tile &tile, int level, const Vec3d &cameraPos, Container &out){
+		int step = 1 << level;
+		int n = tileQuads / step;
+
+		// Vertices of this tile for this frame
+		Vec3d grid[tileQuads + 1][tileQuads + 1];
+		for (int b = 0; b <= n; b++)
+			for (int a = 0; a <= n; a++)
+				grid[a][b] = MorphedVertex(tile.i0 + a * step, tile.j0 + b * step, step, level, cameraPos);
+
+		// Two triangles per quad, wound so the normal faces up
+		for (int b = 0; b < n; b++){
+			for (int a = 0; a < n; a++){
+				Triangle t1, t2;
+				t1.p[0] = grid[a][b];	t1.p[1] = grid[a][b + 1];		t1.p[2] = grid[a + 1][b + 1];
+				t2.p[0] = grid[a][b];	t2.p[1] = grid[a + 1][b + 1];	t2.p[2] = grid[a + 1][b];
+				t1.col = t2.col = 0.0f;
+				out.push_back(t1);
+				out.push_back(t2);
+			}
+		}
+	}
+};
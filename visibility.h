@@ -0,0 +1,215 @@
+#pragma once
+
+#include "pipeline.h"
+
+#include <cfloat>
+#include <cstdint>
+
+// Draws a mesh through the pipeline, keeping backface and view results from frame to frame.
+// Triangles are grouped into clusters of 64 in file order. Each cluster keeps which of its
+// triangles faced the camera and whether it was wholly outside the view, together with a
+// margin: how far the camera can move or turn before any of those results could change.
+// A cluster is tested again only once the camera has gone past its margin, so a small move
+// re-tests just the clusters near a silhouette or the edge of the view.
+// Triangles reach the pipeline in the same order and with the same arithmetic as
+// Pipeline::Render, so the draw list is the same as a full recompute
+class VisibilityCache {
+public:
+	static const int clusterSize = 64;
+
+	// Counts for the last frame
+	size_t nClusters = 0;
+	size_t nFacingChecks = 0;	// Clusters whose triangles were tested for facing the camera
+	size_t nViewChecks = 0;		// Clusters tested against the view volume
+	size_t nCulled = 0;			// Clusters skipped as outside the view
+
+	// Same as pipeline.Render(camera, mesh, out)
+	void Render(Pipeline &pipeline, Camera &camera, const Mesh &mesh, DrawList &out){
+		// Begin sets the world matrix used to build the lit triangles
+		pipeline.Begin(camera);
+		if (&mesh != source || mesh.tris.size() != lit.size()){
+			Build(pipeline, mesh);
+		}
+		TrackCamera(pipeline);
+
+		nFacingChecks = 0;
+		nViewChecks = 0;
+		nCulled = 0;
+		for (auto &c : clusters){
+			// Each plane moves past the cluster by at most the camera's travel plus the turn
+			// of the plane normals times the cluster's distance, which grows by the travel too
+			double moved = travel - c.travelAtView;
+			double turned = turn - c.turnAtView;
+			if (moved + turned * (c.distanceAtView + moved) >= c.viewMargin){
+				CheckView(pipeline, c);
+			}
+			if (c.bOutside){
+				nCulled++;
+				continue;
+			}
+
+			// Turning never changes which way a triangle faces
+			if (travel - c.travelAtFacing >= c.facingMargin){
+				CheckFacing(pipeline, c);
+			}
+			for (uint64_t bits = c.frontFacing; bits != 0; bits &= bits - 1){
+				pipeline.SubmitLit(lit[c.first + __builtin_ctzll(bits)]);
+			}
+		}
+
+		pipeline.End(out);
+	}
+
+	// Forget everything, the next Render starts again from the mesh
+	void Invalidate(){
+		source = nullptr;
+	}
+
+private:
+	class Cluster {
+	public:
+		uint32_t first = 0;
+		uint32_t count = 0;
+		Vec3d centre;
+		float radius = 0;
+
+		uint64_t frontFacing = 0;		// Bit i is set if triangle first + i faced the camera
+		float facingMargin = -1.0f;		// Travel before any triangle could turn round, negative to test
+		double travelAtFacing = 0;
+
+		bool bOutside = false;
+		float viewMargin = -1.0f;		// Plane movement before the cluster could cross the view edge
+		float distanceAtView = 0;		// From the camera to the far side of the cluster
+		double travelAtView = 0;
+		double turnAtView = 0;
+	};
+
+	const Mesh *source = nullptr;
+	TrackedVector<Triangle, MemTag::Visibility> lit;	// World space with colour, as Submit lights them
+	TrackedVector<Vec3d, MemTag::Visibility> normals;
+	TrackedVector<Cluster, MemTag::Visibility> clusters;
+
+	// Camera travel and turn of the view planes summed over all frames. The sums are at least the
+	// straight line change since any earlier frame, so margins can be compared against differences
+	double travel = 0;
+	double turn = 0;
+	bool bHaveCamera = false;
+	Vec3d lastPos;
+	Vec3d lastNormals[6];
+
+	// View planes a cluster can be culled against. The pipeline does not cull at the far plane
+	static constexpr int viewPlanes[5] = { 0, 2, 3, 4, 5 };
+
+	void Build(Pipeline &pipeline, const Mesh &mesh){
+		source = &mesh;
+		lit.clear();
+		normals.clear();
+		clusters.clear();
+		lit.reserve(mesh.tris.size());
+		normals.reserve(mesh.tris.size());
+
+		for (auto &tri : mesh.tris){
+			Triangle triTransformed = pipeline.ToWorld(tri);
+			Vec3d normal = Pipeline::FaceNormal(triTransformed);
+			triTransformed.col = Pipeline::Shade(normal);
+			lit.push_back(triTransformed);
+			normals.push_back(normal);
+		}
+
+		for (size_t first = 0; first < lit.size(); first += clusterSize){
+			Cluster c;
+			c.first = (uint32_t)first;
+			c.count = (uint32_t)std::min(lit.size() - first, (size_t)clusterSize);
+
+			Vec3d boxMin = lit[first].p[0], boxMax = boxMin;
+			for (uint32_t i = c.first; i < c.first + c.count; i++){
+				for (auto &p : lit[i].p){
+					boxMin = Vec3d(std::min(boxMin.x, p.x), std::min(boxMin.y, p.y), std::min(boxMin.z, p.z));
+					boxMax = Vec3d(std::max(boxMax.x, p.x), std::max(boxMax.y, p.y), std::max(boxMax.z, p.z));
+				}
+			}
+			c.centre = (boxMin + boxMax) * 0.5f;
+			for (uint32_t i = c.first; i < c.first + c.count; i++){
+				for (auto &p : lit[i].p){
+					Vec3d offset = p - c.centre;
+					c.radius = std::max(c.radius, offset.vec_length(offset));
+				}
+			}
+			clusters.push_back(c);
+		}
+		nClusters = clusters.size();
+		bHaveCamera = false;
+	}
+
+	void TrackCamera(Pipeline &pipeline){
+		Vec3d pos = pipeline.CameraPos();
+		if (bHaveCamera){
+			Vec3d moved = pos - lastPos;
+			travel += moved.vec_length(moved);
+
+			// Largest change in any plane normal, the chord is at least the sideways shift
+			// of a point at unit distance
+			float chord = 0.0f;
+			for (int i : viewPlanes){
+				Vec3d change = pipeline.frustum.n[i] - lastNormals[i];
+				chord = std::max(chord, change.vec_length(change));
+			}
+			turn += chord;
+		} else {
+			// New mesh or first frame, test every cluster
+			for (auto &c : clusters){
+				c.facingMargin = -1.0f;
+				c.viewMargin = -1.0f;
+			}
+			bHaveCamera = true;
+		}
+		lastPos = pos;
+		for (int i : viewPlanes)
+			lastNormals[i] = pipeline.frustum.n[i];
+	}
+
+	// Allowance for rounding in the facing and plane distances of a cluster, which grows
+	// with the size of the coordinates involved
+	static float Tolerance(Pipeline &pipeline, const Cluster &c){
+		Vec3d pos = pipeline.CameraPos();
+		Vec3d centre = c.centre;
+		return 1e-5f * (pos.vec_length(pos) + centre.vec_length(centre) + c.radius) + 1e-6f;
+	}
+
+	void CheckFacing(Pipeline &pipeline, Cluster &c){
+		nFacingChecks++;
+		c.frontFacing = 0;
+		float margin = FLT_MAX;
+		for (uint32_t i = 0; i < c.count; i++){
+			float d = pipeline.FacingDistance(lit[c.first + i], normals[c.first + i]);
+			if (d < 0.0f)
+				c.frontFacing |= (uint64_t)1 << i;
+			margin = std::min(margin, fabsf(d));
+		}
+
+		c.facingMargin = margin - Tolerance(pipeline, c);
+		c.travelAtFacing = travel;
+	}
+
+	void CheckView(Pipeline &pipeline, Cluster &c){
+		nViewChecks++;
+		Vec3d offset = c.centre - pipeline.CameraPos();
+		float distance = offset.vec_length(offset) + c.radius;
+		float reach = c.radius + Tolerance(pipeline, c);
+
+		// Outside if the whole sphere is behind any plane, by the most of those planes.
+		// Otherwise the margin is how far the nearest plane is from leaving the sphere behind
+		float outsideBy = -FLT_MAX;
+		float insideBy = FLT_MAX;
+		for (int i : viewPlanes){
+			float s = pipeline.frustum.n[i].dot_product(c.centre) + pipeline.frustum.d[i];
+			outsideBy = std::max(outsideBy, -s - reach);
+			insideBy = std::min(insideBy, s + reach);
+		}
+		c.bOutside = outsideBy > 0.0f;
+		c.viewMargin = c.bOutside ? outsideBy : insideBy;
+		c.distanceAtView = distance;
+		c.travelAtView = travel;
+		c.turnAtView = turn;
+	}
+};